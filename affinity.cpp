@@ -0,0 +1,131 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "affinity.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <fstream>
+
+#ifndef __WIN32__
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+
+/* from <numaif.h>, so that libnuma isn't needed */
+#define MPOL_PREFERRED 1
+#endif
+
+using std::string;
+using std::vector;
+
+bool ParseCPUList(const char* list, vector<int>& cpus)
+{
+	cpus.clear();
+	const char* p = list;
+	for (;;)
+	{
+		char* end;
+		long from = strtol(p, &end, 10), to = from;
+		if (end == p || from < 0)
+			return false;
+		if (*end == '-')
+		{
+			p = end + 1;
+			to = strtol(p, &end, 10);
+			if (end == p || to < from)
+				return false;
+		}
+		for (long cpu = from; cpu <= to; ++cpu)
+			cpus.push_back(cpu);
+		if (*end == '\0' || *end == '\n')
+			break;
+		if (*end != ',')
+			return false;
+		p = end + 1;
+	}
+	return !cpus.empty();
+}
+
+int GetNICNode(const char* interface)
+{
+	std::ifstream ifs((string("/sys/class/net/") + interface +
+				"/device/numa_node").c_str());
+	int node = -1;
+	if (!(ifs >> node))
+		return -1;
+	return node;
+}
+
+bool GetNodeCPUs(int node, vector<int>& cpus)
+{
+	std::ifstream ifs(("/sys/devices/system/node/node" +
+				std::to_string(node) + "/cpulist").c_str());
+	string list;
+	return std::getline(ifs, list) && ParseCPUList(list.c_str(), cpus);
+}
+
+bool PinCPU(int cpu)
+{
+#ifdef __linux__
+	if (cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof set, &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+bool PreferNode(int node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+	if (node < 0 || node >= (int)sizeof(unsigned long) * 8)
+		return false;
+	unsigned long mask = 1UL << node;
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+			sizeof mask * 8) == 0;
+#else
+	(void)node;
+	return false;
+#endif
+}
+
+unsigned int GetCPUCount()
+{
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+#endif
+#ifdef _SC_NPROCESSORS_ONLN
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0)
+		return cpus;
+#endif
+	return 1;
+}
@@ -0,0 +1,45 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _AFFINITY_HPP_
+#define _AFFINITY_HPP_
+
+#include <vector>
+
+/*
+ * Worker placement (Linux only, elsewhere these fail)
+ *
+ * ParseCPUList:  parse a cpu list such as "0-3,8,10-11"
+ * GetNICNode:    the NUMA node of a network interface, -1 if unknown
+ * GetNodeCPUs:   the cpus of a NUMA node
+ * PinCPU:        run the calling process on cpu only
+ * PreferNode:    allocate the calling process' memory on node, when
+ *                first touched, if there is memory left on it
+ * GetCPUCount:   the number of cpus the calling process may run on (this
+ *                one works elsewhere, if not as well)
+ */
+bool ParseCPUList(const char* list, std::vector<int>& cpus);
+int GetNICNode(const char* interface);
+bool GetNodeCPUs(int node, std::vector<int>& cpus);
+bool PinCPU(int cpu);
+bool PreferNode(int node);
+unsigned int GetCPUCount();
+
+#endif
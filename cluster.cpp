@@ -0,0 +1,425 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "cluster.hpp"
+
+/* --coordinator and --agent are not supported on Windows */
+#ifndef __WIN32__
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+using std::string;
+using std::vector;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+extern bool abort_ping;
+
+static bool SendAll(int s, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t r = send(s, data, size, MSG_NOSIGNAL);
+		if (r <= 0)
+			return false;
+		data += r;
+		size -= r;
+	}
+	return true;
+}
+
+static string Hello(const string& version)
+{
+	return "AGENT " + version + "\n";
+}
+
+Coordinator::Coordinator(const char* version)
+: m_version(version), m_socket(-1)
+{
+}
+
+Coordinator::~Coordinator()
+{
+	for (size_t i = 0; i < m_agents.size(); ++i)
+	{
+		Drop(m_agents[i]);
+		delete m_agents[i].stats;
+	}
+	if (m_socket != -1)
+		close(m_socket);
+}
+
+bool Coordinator::Listen(const char* port)
+{
+	struct addrinfo *res = NULL, resTmp;
+	memset(&resTmp, 0, sizeof resTmp);
+	resTmp.ai_family = AF_INET6;
+	resTmp.ai_socktype = SOCK_STREAM;
+	resTmp.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(NULL, port, &resTmp, &res) != 0)
+	{
+		/* no IPv6, listen on IPv4 only */
+		resTmp.ai_family = AF_INET;
+		if (getaddrinfo(NULL, port, &resTmp, &res) != 0)
+			return false;
+	}
+
+	m_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (m_socket == -1)
+	{
+		freeaddrinfo(res);
+		return false;
+	}
+	int on = 1, off = 0;
+	setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (res->ai_family == AF_INET6)
+		setsockopt(m_socket, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
+	bool ok = bind(m_socket, res->ai_addr, res->ai_addrlen) == 0 &&
+		listen(m_socket, 64) == 0;
+	freeaddrinfo(res);
+	return ok;
+}
+
+/*
+ * Accept: wait for one agent to connect and say hello
+ */
+bool Coordinator::Accept()
+{
+	for (;;)
+	{
+		struct pollfd pfd = { m_socket, POLLIN, 0 };
+		if (abort_ping)
+			return false;
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof addr;
+		int s = accept(m_socket, (struct sockaddr*)&addr, &addrlen);
+		if (s == -1)
+			continue;
+
+		char host[NI_MAXHOST], serv[NI_MAXSERV];
+		if (getnameinfo((struct sockaddr*)&addr, addrlen, host, sizeof host,
+					serv, sizeof serv, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		{
+			strcpy(host, "unknown");
+			strcpy(serv, "0");
+		}
+
+		Peer agent;
+		agent.socket = s;
+		agent.name = string(host) + ":" + serv;
+		agent.stats = NULL;
+		agent.done = false;
+
+		/* the hello must match our version */
+		string expect = Hello(m_version);
+		char buf[128];
+		size_t len = 0;
+		pfd.fd = s;
+		while (len < sizeof buf && (len == 0 || buf[len - 1] != '\n') &&
+				poll(&pfd, 1, 5000) > 0)
+		{
+			ssize_t r = recv(s, buf + len, 1, 0);
+			if (r <= 0)
+				break;
+			len += r;
+		}
+		if (string(buf, len) != expect)
+		{
+			fprintf(stderr, "agent %s: version mismatch, expected %s",
+					agent.name.c_str(), expect.c_str());
+			close(s);
+			continue;
+		}
+
+		int on = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+		agent.stats = new Statistics;
+		agent.stats->Clear();
+		m_agents.push_back(agent);
+		return true;
+	}
+}
+
+/*
+ * Start: send the configuration to all agents, which start running after
+ *        delay ms so that they begin (close to) simultaneously
+ */
+bool Coordinator::Start(const vector<string>& args, unsigned int delay)
+{
+	string config;
+	for (vector<string>::const_iterator i = args.begin(); i != args.end(); ++i)
+	{
+		if (i->find('\n') != string::npos)
+			return false;
+		config += "ARG " + *i + "\n";
+	}
+	string start = "START " + std::to_string(delay) + "\n";
+
+	/* send the configuration first, so that only START is time critical */
+	for (size_t i = 0; i < m_agents.size(); ++i)
+	{
+		string stream = config + "STREAM " + std::to_string(i) + "\n";
+		if (!SendAll(m_agents[i].socket, stream.c_str(), stream.size()))
+			Drop(m_agents[i]);
+	}
+	for (size_t i = 0; i < m_agents.size(); ++i)
+		if (m_agents[i].socket != -1 &&
+				!SendAll(m_agents[i].socket, start.c_str(), start.size()))
+			Drop(m_agents[i]);
+	return GetRunning() > 0;
+}
+
+void Coordinator::Stop()
+{
+	for (size_t i = 0; i < m_agents.size(); ++i)
+		if (m_agents[i].socket != -1 &&
+				!SendAll(m_agents[i].socket, "STOP\n", 5))
+			Drop(m_agents[i]);
+}
+
+void Coordinator::Drop(Peer& agent)
+{
+	if (agent.socket != -1)
+	{
+		close(agent.socket);
+		agent.socket = -1;
+	}
+	agent.done = true;
+}
+
+size_t Coordinator::GetRunning() const
+{
+	size_t running = 0;
+	for (size_t i = 0; i < m_agents.size(); ++i)
+		if (!m_agents[i].done)
+			running++;
+	return running;
+}
+
+/*
+ * Read: consume the STATS frames an agent has sent, keeping the latest
+ */
+bool Coordinator::Read(Peer& agent)
+{
+	char buf[64 * 1024];
+	ssize_t r = recv(agent.socket, buf, sizeof buf, 0);
+	if (r <= 0)
+		return false;
+	agent.buffer.append(buf, r);
+
+	for (;;)
+	{
+		size_t eol = agent.buffer.find('\n');
+		if (eol == string::npos)
+			return true;
+
+		size_t size = 0;
+		int final = 0;
+		if (sscanf(agent.buffer.c_str(), "STATS %zu %d", &size, &final) != 2)
+			return false;
+		if (agent.buffer.size() < eol + 1 + size)
+			return true;
+
+		string error;
+		if (!agent.stats->Parse(agent.buffer.substr(eol + 1, size), error))
+		{
+			fprintf(stderr, "agent %s: %s\n", agent.name.c_str(),
+					error.c_str());
+			return false;
+		}
+		agent.buffer.erase(0, eol + 1 + size);
+		if (final)
+		{
+			Drop(agent);
+			return true;
+		}
+	}
+}
+
+/*
+ * Poll: wait up to timeout ms for statistics, false when no agent is left
+ */
+bool Coordinator::Poll(int timeout)
+{
+	vector<struct pollfd> pfds;
+	vector<size_t> index;
+	for (size_t i = 0; i < m_agents.size(); ++i)
+	{
+		if (m_agents[i].done)
+			continue;
+		struct pollfd pfd = { m_agents[i].socket, POLLIN, 0 };
+		pfds.push_back(pfd);
+		index.push_back(i);
+	}
+	if (pfds.empty())
+		return false;
+
+	if (poll(&pfds[0], pfds.size(), timeout) > 0)
+	{
+		for (size_t i = 0; i < pfds.size(); ++i)
+		{
+			if (!pfds[i].revents)
+				continue;
+			Peer& agent = m_agents[index[i]];
+			if (!Read(agent))
+			{
+				fprintf(stderr, "agent %s: lost connection\n",
+						agent.name.c_str());
+				Drop(agent);
+			}
+		}
+	}
+	return GetRunning() > 0;
+}
+
+void Coordinator::Collect(Statistics& result) const
+{
+	result.Clear();
+	for (size_t i = 0; i < m_agents.size(); ++i)
+		result.Merge(*m_agents[i].stats);
+}
+
+Agent::Agent(const char* version)
+: m_version(version), m_socket(-1)
+{
+}
+
+Agent::~Agent()
+{
+	if (m_socket != -1)
+		close(m_socket);
+}
+
+/*
+ * Connect: connect to the coordinator at host:port (or [host]:port)
+ */
+bool Agent::Connect(const char* coordinator)
+{
+	string host = coordinator, port;
+	size_t colon = host.rfind(':');
+	if (colon == string::npos)
+		return false;
+	port = host.substr(colon + 1);
+	host.erase(colon);
+	if (host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
+
+	if (m_socket != -1)
+	{
+		close(m_socket);
+		m_socket = -1;
+	}
+
+	struct addrinfo *res = NULL, resTmp;
+	memset(&resTmp, 0, sizeof resTmp);
+	resTmp.ai_family = AF_UNSPEC;
+	resTmp.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &resTmp, &res) != 0)
+		return false;
+
+	for (struct addrinfo* ai = res; ai; ai = ai->ai_next)
+	{
+		m_socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (m_socket == -1)
+			continue;
+		if (connect(m_socket, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(m_socket);
+		m_socket = -1;
+	}
+	freeaddrinfo(res);
+	if (m_socket == -1)
+		return false;
+
+	int on = 1;
+	setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	string hello = Hello(m_version);
+	return SendAll(m_socket, hello.c_str(), hello.size());
+}
+
+bool Agent::ReadLine(string& line)
+{
+	line.clear();
+	char c;
+	while (recv(m_socket, &c, 1, 0) == 1)
+	{
+		if (c == '\n')
+			return true;
+		line += c;
+	}
+	return false;
+}
+
+/*
+ * Receive: wait for the configuration, our stream and the START delay
+ */
+bool Agent::Receive(vector<string>& args, unsigned int& stream,
+		unsigned int& delay)
+{
+	string line;
+	while (ReadLine(line))
+	{
+		if (line.compare(0, 4, "ARG ") == 0)
+			args.push_back(line.substr(4));
+		else if (line.compare(0, 7, "STREAM ") == 0)
+			stream = strtoul(line.c_str() + 7, NULL, 10);
+		else if (line.compare(0, 6, "START ") == 0)
+		{
+			delay = strtoul(line.c_str() + 6, NULL, 10);
+			return true;
+		} else
+			return false;
+	}
+	return false;
+}
+
+bool Agent::Send(const Statistics& stats, bool final)
+{
+	string text = stats.Format();
+	string header = "STATS " + std::to_string(text.size()) + " " +
+		(final ? "1" : "0") + "\n";
+	return SendAll(m_socket, header.c_str(), header.size()) &&
+		SendAll(m_socket, text.c_str(), text.size());
+}
+
+/*
+ * Wait: wait up to timeout ms, true if the coordinator asked us to stop
+ *       (or went away)
+ */
+bool Agent::Wait(int timeout)
+{
+	struct pollfd pfd = { m_socket, POLLIN, 0 };
+	return poll(&pfd, 1, timeout) != 0;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _CLUSTER_HPP_
+#define _CLUSTER_HPP_
+
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
+
+/*
+ * Distributed load generation: agents connect to a coordinator, which
+ * hands them its command line and a start delay, and the agents stream
+ * their statistics back as text (see Statistics::Format). Agents must run
+ * the same version as the coordinator, which parses its command line.
+ *
+ *   agent > AGENT <version>
+ *   coord < ARG <argument>        (one per argument)
+ *   coord < STREAM <agent>        (its random substream, 0 and up)
+ *   coord < START <delay ms>
+ *   agent > STATS <size> <final>  (followed by size bytes of statistics)
+ *   coord < STOP                  (on abort, agents send their final STATS)
+ */
+
+/*
+ * Coordinator: waits for agents and merges the statistics they send
+ */
+class Coordinator
+{
+	public:
+		Coordinator(const char* version);
+		~Coordinator();
+
+		bool Listen(const char* port);
+		bool Accept();
+		bool Start(const std::vector<std::string>& args, unsigned int delay);
+		void Stop();
+		bool Poll(int timeout);
+
+		size_t GetAgents() const { return m_agents.size(); }
+		size_t GetRunning() const;
+		const std::string& GetName(size_t agent) const
+			{ return m_agents[agent].name; }
+		const Statistics& GetStatistics(size_t agent) const
+			{ return *m_agents[agent].stats; }
+		void Collect(Statistics& result) const;
+	private:
+		struct Peer
+		{
+			int socket;
+			std::string name;
+			std::string buffer;
+			Statistics* stats;
+			bool done;
+		};
+		bool Read(Peer& agent);
+		void Drop(Peer& agent);
+
+		std::string m_version;
+		int m_socket;
+		std::vector<Peer> m_agents;
+};
+
+/*
+ * Agent: receives the configuration and reports statistics back
+ */
+class Agent
+{
+	public:
+		Agent(const char* version);
+		~Agent();
+
+		bool Connect(const char* coordinator);
+		bool Receive(std::vector<std::string>& args, unsigned int& stream,
+				unsigned int& delay);
+		bool Send(const Statistics& stats, bool final);
+		bool Wait(int timeout);
+	private:
+		bool ReadLine(std::string& line);
+
+		std::string m_version;
+		int m_socket;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "generator.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+using std::string;
+
+AddressGenerator::AddressGenerator()
+: m_count(0), m_exponent(0)
+{
+}
+
+/*
+ * Parse: set up from "pattern,count[,uniform|zipf[:s]]", false (with
+ *        error) if it is not valid
+ */
+bool AddressGenerator::Parse(const char* spec, string& error)
+{
+	string pattern = spec, distribution;
+	size_t comma = pattern.rfind(',');
+	if (comma != string::npos &&
+			(pattern.compare(comma + 1, string::npos, "uniform") == 0 ||
+			 pattern.compare(comma + 1, 4, "zipf") == 0))
+	{
+		distribution = pattern.substr(comma + 1);
+		pattern.erase(comma);
+		comma = pattern.rfind(',');
+	}
+	if (comma == string::npos)
+	{
+		error = "expected pattern,count[,uniform|zipf[:s]]";
+		return false;
+	}
+	string count = pattern.substr(comma + 1);
+	pattern.erase(comma);
+
+	size_t n = pattern.find("%n");
+	if (n == string::npos)
+	{
+		error = "the pattern has no %n";
+		return false;
+	}
+	m_prefix = pattern.substr(0, n);
+	m_suffix = pattern.substr(n + 2);
+
+	char* end;
+	m_count = strtoull(count.c_str(), &end, 10);
+	if (m_count == 0 || *end != '\0')
+	{
+		error = "the count must be 1 or more";
+		return false;
+	}
+
+	m_exponent = 0;
+	m_cdf.clear();
+	if (!distribution.empty() && distribution != "uniform")
+	{
+		m_exponent = 1;
+		if (distribution.size() > 4)
+		{
+			m_exponent = strtod(distribution.c_str() + 5, &end);
+			if (distribution[4] != ':' || *end != '\0')
+				m_exponent = 0;
+		}
+		if (!(m_exponent > 0))
+		{
+			error = "zipf takes an exponent greater than 0, eg. zipf:1.1";
+			return false;
+		}
+		if (m_count > MAX_ZIPF_VALUES)
+		{
+			error = "zipf takes at most " +
+				std::to_string((unsigned long)MAX_ZIPF_VALUES) + " values";
+			return false;
+		}
+		m_cdf.resize(m_count);
+		double sum = 0;
+		for (uint64_t k = 0; k < m_count; ++k)
+			m_cdf[k] = sum += pow(k + 1, -m_exponent);
+		for (uint64_t k = 0; k < m_count; ++k)
+			m_cdf[k] /= sum;
+	}
+	return true;
+}
+
+/*
+ * Next: draw the next address
+ */
+string AddressGenerator::Next(Random& random) const
+{
+	uint64_t value;
+	if (m_cdf.empty())
+		value = random.Next() % m_count;
+	else
+	{
+		value = std::upper_bound(m_cdf.begin(), m_cdf.end(),
+				random.Uniform()) - m_cdf.begin();
+		if (value >= m_count)
+			value = m_count - 1;
+	}
+	return m_prefix + std::to_string((unsigned long long)value + 1) +
+		m_suffix;
+}
+
+/*
+ * Describe: the pattern and distribution, with the share of the draws
+ *           that go to the most common 1% of the values (the hit rate a
+ *           cache of that size would see)
+ */
+string AddressGenerator::Describe() const
+{
+	uint64_t top = (m_count + 99) / 100;
+	double share = m_cdf.empty() ? (double)top / m_count : m_cdf[top - 1];
+	char buf[128];
+	if (m_cdf.empty())
+		snprintf(buf, sizeof buf, ", %llu values, uniform",
+				(unsigned long long)m_count);
+	else
+		snprintf(buf, sizeof buf, ", %llu values, zipf %.2lf",
+				(unsigned long long)m_count, m_exponent);
+	string description = m_prefix + "%n" + m_suffix + buf;
+	snprintf(buf, sizeof buf, " (top 1%% of values in %.0lf%% of draws)",
+			share * 100);
+	return description + buf;
+}
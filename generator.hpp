@@ -0,0 +1,59 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _GENERATOR_HPP_
+#define _GENERATOR_HPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "random.hpp"
+
+/*
+ * AddressGenerator: envelope addresses from a pattern, "%n" in it replaced
+ *                   by one of count values (1..count) drawn uniformly or
+ *                   by Zipf's law (value k drawn in proportion to 1/k^s),
+ *                   so that server-side caches see a controlled hit rate
+ *
+ * Parse takes "pattern,count[,uniform|zipf[:s]]" (s defaults to 1). The
+ * Zipf distribution is a table of count entries, built once before
+ * forking.
+ */
+class AddressGenerator
+{
+	public:
+		enum { MAX_ZIPF_VALUES = 16 * 1024 * 1024 };
+
+		AddressGenerator();
+
+		bool Parse(const char* spec, std::string& error);
+		bool Any() const { return m_count > 0; }
+		std::string Next(Random& random) const;
+		std::string Describe() const;
+	private:
+		std::string m_prefix;
+		std::string m_suffix;
+		uint64_t m_count;
+		double m_exponent;	/* 0 is uniform */
+		std::vector<double> m_cdf;
+};
+
+#endif
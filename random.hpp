@@ -0,0 +1,61 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _RANDOM_HPP_
+#define _RANDOM_HPP_
+
+#include <stdint.h>
+
+/*
+ * Random: small and fast pseudo random generator (xorshift64*), so that
+ *         workload choices don't depend on the platform's rand()
+ */
+class Random
+{
+	public:
+		Random(uint64_t seed = 1) { Seed(seed); }
+
+		/* splitmix64 scrambles the seed, and avoids the zero state */
+		void Seed(uint64_t seed) { m_state = Mix(seed) | 1; }
+		static uint64_t Mix(uint64_t z)
+		{
+			z += 0x9e3779b97f4a7c15ULL;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			return z ^ (z >> 31);
+		}
+		/* the seed of the n-th stream of seed (eg. of a worker), unrelated
+		   to the other streams, and streams of streams, of seed */
+		static uint64_t Substream(uint64_t seed, uint64_t n)
+			{ return Mix(seed ^ Mix(n)); }
+		uint64_t Next()
+		{
+			m_state ^= m_state >> 12;
+			m_state ^= m_state << 25;
+			m_state ^= m_state >> 27;
+			return m_state * 0x2545f4914f6cdd1dULL;
+		}
+		/* uniform in [0, 1) */
+		double Uniform() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+	private:
+		uint64_t m_state;
+};
+
+#endif
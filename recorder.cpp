@@ -0,0 +1,174 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "recorder.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fstream>
+#include <algorithm>
+
+#ifndef __WIN32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using std::string;
+using std::vector;
+
+static const char* MAGIC = "SMTPPING-EVENTS";
+
+Recorder::Recorder()
+: m_data(NULL), m_size(0), m_mapped(false), m_header(NULL)
+{
+}
+
+Recorder::~Recorder()
+{
+#ifndef __WIN32__
+	if (m_mapped)
+	{
+		munmap(m_data, m_size);
+		return;
+	}
+#endif
+	free(m_data);
+}
+
+/*
+ * Create: create the file at path and map it, with a ring of events for
+ *         each worker
+ */
+bool Recorder::Create(const char* path, const char* version,
+		unsigned int workers, unsigned int events,
+		const vector<string>& targets, string& error)
+{
+#ifdef __WIN32__
+	(void)path; (void)version; (void)workers; (void)events; (void)targets;
+	error = "not supported on this platform";
+	return false;
+#else
+	m_size = sizeof(Header) + (size_t)workers * sizeof(Event) * (events + 1);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, m_size) != 0)
+	{
+		error = strerror(errno);
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+	void* p = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		error = string("mmap: ") + strerror(errno);
+		return false;
+	}
+	m_data = (char*)p;
+	m_mapped = true;
+
+	/* the file is zero-filled, so every ring starts out empty */
+	m_header = (Header*)m_data;
+	strncpy(m_header->magic, MAGIC, sizeof m_header->magic - 1);
+	strncpy(m_header->version, version, sizeof m_header->version - 1);
+	m_header->event_size = sizeof(Event);
+	m_header->workers = workers;
+	m_header->events = events;
+	m_header->targets = std::min(targets.size(), (size_t)TARGETS);
+	for (size_t i = 0; i < m_header->targets; ++i)
+		strncpy(m_header->target[i], targets[i].c_str(), TARGET_SIZE - 1);
+	return true;
+#endif
+}
+
+void Recorder::SetEpoch(double epoch)
+{
+	m_header->epoch = epoch;
+}
+
+/*
+ * Load: read a recorded file for decoding
+ */
+bool Recorder::Load(const char* path, const char* version, string& error)
+{
+	std::ifstream ifs(path, std::ios::binary);
+	if (!ifs.good())
+	{
+		error = "could not be opened";
+		return false;
+	}
+	ifs.seekg(0, std::ios::end);
+	m_size = ifs.tellg();
+	ifs.seekg(0, std::ios::beg);
+	if (m_size < sizeof(Header))
+	{
+		error = "not an event file";
+		return false;
+	}
+	m_data = (char*)malloc(m_size);
+	if (!m_data || !ifs.read(m_data, m_size))
+	{
+		error = "could not be read";
+		return false;
+	}
+
+	m_header = (Header*)m_data;
+	if (strncmp(m_header->magic, MAGIC, sizeof m_header->magic) != 0)
+	{
+		error = "not an event file";
+		return false;
+	}
+	m_header->version[sizeof m_header->version - 1] = '\0';
+	if (strcmp(m_header->version, version) != 0 ||
+			m_header->event_size != sizeof(Event))
+	{
+		error = string("recorded by another build (") +
+			m_header->version + ")";
+		return false;
+	}
+	if (m_header->events == 0 || m_size < sizeof(Header) +
+			(size_t)m_header->workers * sizeof(Event) *
+			(m_header->events + 1))
+	{
+		error = "truncated";
+		return false;
+	}
+	return true;
+}
+
+string Recorder::GetTarget(unsigned int target) const
+{
+	if (target >= m_header->targets)
+		return "";
+	return string(m_header->target[target],
+			strnlen(m_header->target[target], TARGET_SIZE));
+}
+
+void Recorder::GetEvents(unsigned int worker, vector<Event>& events) const
+{
+	const Ring* ring = GetRing(worker);
+	uint64_t first = ring->written > m_header->events ?
+		ring->written - m_header->events : 0;
+	for (uint64_t i = first; i < ring->written; ++i)
+		events.push_back(ring->slot[i % m_header->events]);
+}
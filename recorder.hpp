@@ -0,0 +1,123 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _RECORDER_HPP_
+#define _RECORDER_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "session.hpp"
+
+/*
+ * Event: one transaction, as recorded by --record (64 bytes)
+ */
+enum { EVENT_POOLED = 1, EVENT_IPV4 = 2, EVENT_IPV6 = 4 };
+struct Event
+{
+	double start;		/* ms, GetHighResTime() */
+	float time[PHASE_MAX];	/* ms, -1 if not reached */
+	float total;		/* ms, -1 if it failed */
+	uint32_t worker;
+	uint32_t seq;
+	uint32_t bytes;		/* of the message */
+	uint16_t rcpts;
+	uint16_t reply;		/* the last reply code */
+	uint8_t failed;		/* phase, PHASE_MAX if delivered */
+	uint8_t target;		/* index of the @server */
+	uint8_t transfer;
+	uint8_t flags;		/* EVENT_POOLED, and the family connected */
+};
+
+/*
+ * Recorder: a flight recorder of the last events of each worker
+ *
+ * Each worker has a ring of fixed-size events in a file that is mapped
+ * shared before the workers are forked, so recording is a copy to memory and
+ * whatever was recorded is kept even if the run is killed:
+ *
+ *   header     (magic, version, sizes, epoch and target names)
+ *   worker 0   (the number of events written, then the ring)
+ *   worker 1
+ *   ...
+ *
+ * Each ring is only written by its worker. Files are only decoded by the
+ * same version.
+ */
+class Recorder
+{
+	public:
+		enum { TARGETS = 16, TARGET_SIZE = 64 };
+
+		Recorder();
+		~Recorder();
+
+		bool Create(const char* path, const char* version,
+				unsigned int workers, unsigned int events,
+				const std::vector<std::string>& targets,
+				std::string& error);
+		void SetEpoch(double epoch);
+		void Add(const Event& event)
+		{
+			Ring* ring = GetRing(event.worker);
+			ring->slot[ring->written % m_header->events] = event;
+			ring->written++;
+		}
+
+		bool Load(const char* path, const char* version, std::string& error);
+		double GetEpoch() const { return m_header->epoch; }
+		unsigned int GetWorkers() const { return m_header->workers; }
+		std::string GetTarget(unsigned int target) const;
+		/* the events kept of a worker, oldest first */
+		void GetEvents(unsigned int worker, std::vector<Event>& events) const;
+	private:
+		struct Header
+		{
+			char magic[16];
+			char version[16];
+			uint32_t event_size;
+			uint32_t workers;
+			uint32_t events;	/* per worker */
+			uint32_t targets;
+			double epoch;		/* ms, start of the run */
+			char target[TARGETS][TARGET_SIZE];
+		};
+		struct Ring
+		{
+			uint64_t written;
+			char padding[sizeof(Event) - sizeof(uint64_t)];
+			Event slot[1];
+		};
+
+		Ring* GetRing(unsigned int worker) const
+		{
+			return (Ring*)(m_data + sizeof(Header) + worker *
+					(sizeof(Event) * (m_header->events + 1)));
+		}
+
+		char* m_data;
+		size_t m_size;
+		bool m_mapped;
+		Header* m_header;
+};
+
+#endif
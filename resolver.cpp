@@ -35,11 +35,13 @@
 #endif
 
 #include <memory.h>
+#include <errno.h>
 
 /*
  * initialize thread-safe m_res structure
  */
 Resolver::Resolver()
+: m_status(STATUS_OK), m_size(0)
 {
 #ifdef __WIN32__
 	m_hDnsInst = LoadLibrary("DNSAPI.DLL");
@@ -70,9 +72,30 @@ Resolver::~Resolver()
 #endif
 }
 
+/*
+ * use the (IPv4) name server at address instead of the system's
+ */
+bool Resolver::SetServer(const std::string& address, unsigned short port)
+{
+#ifdef __WIN32__
+	return false;
+#else
+	struct in_addr addr;
+	if (inet_pton(AF_INET, address.c_str(), &addr) != 1)
+		return false;
+	m_res.nsaddr_list[0].sin_family = AF_INET;
+	m_res.nsaddr_list[0].sin_addr = addr;
+	m_res.nsaddr_list[0].sin_port = htons(port);
+	m_res.nscount = 1;
+	return true;
+#endif
+}
+
 bool Resolver::Lookup(const std::string& domain, RecordType recordType, std::vector<std::string>& result)
 {
 	std::map<unsigned int, std::vector<std::string> > prioMap;
+	m_status = STATUS_ERROR;
+	m_size = 0;
 
 #ifdef __WIN32__
 	if (!m_lpfnDnsRecordListFree || !m_lpfnDnsQuery)
@@ -98,8 +121,17 @@ bool Resolver::Lookup(const std::string& domain, RecordType recordType, std::vec
 	}
 
 	PDNS_RECORD pRec = NULL;
-	if (m_lpfnDnsQuery(domain.c_str(), req_rec_type, DNS_QUERY_STANDARD, NULL, &pRec, NULL) != ERROR_SUCCESS)
+	DNS_STATUS status = m_lpfnDnsQuery(domain.c_str(), req_rec_type, DNS_QUERY_STANDARD, NULL, &pRec, NULL);
+	if (status != ERROR_SUCCESS)
+	{
+		if (status == DNS_ERROR_RCODE_NAME_ERROR)
+			m_status = STATUS_NXDOMAIN;
+		else if (status == DNS_ERROR_RCODE_SERVER_FAILURE)
+			m_status = STATUS_SERVFAIL;
+		else if (status == ERROR_TIMEOUT)
+			m_status = STATUS_TIMEOUT;
 		return false;
+	}
 
 	PDNS_RECORD pRecFirst = pRec;
 	while (pRec)
@@ -169,13 +201,27 @@ bool Resolver::Lookup(const std::string& domain, RecordType recordType, std::vec
 	if (len < 0)
 	{
 		if (m_res.res_h_errno == NO_DATA)
+		{
+			m_status = STATUS_OK;
 			return true;
+		}
 
+		/* SERVFAIL, timeouts and unreachable servers are all TRY_AGAIN,
+		   a SERVFAIL leaves its response behind and errno tells the
+		   others apart */
+		header = (HEADER*)&response;
+		if (m_res.res_h_errno == HOST_NOT_FOUND)
+			m_status = STATUS_NXDOMAIN;
+		else if (header->qr && header->rcode == SERVFAIL)
+			m_status = STATUS_SERVFAIL;
+		else if (m_res.res_h_errno == TRY_AGAIN && errno == ETIMEDOUT)
+			m_status = STATUS_TIMEOUT;
 		return false;
 	}
 	if (len > (int)sizeof response) {
 		return false;
 	}
+	m_size = len;
 
 	/* a valid response must at least contain the fixed header */
 	if (len < HFIXEDSZ)
@@ -285,5 +331,6 @@ bool Resolver::Lookup(const std::string& domain, RecordType recordType, std::vec
 		std::sort(i->second.begin(), i->second.end());
 		result.insert(result.end(), i->second.begin(), i->second.end());
 	}
+	m_status = STATUS_OK;
 	return true;
 }
@@ -52,12 +52,26 @@ class Resolver
 			RR_MX,
 			RR_A,
 			RR_AAAA,
+			RR_MAX
 		} RecordType;
 
+		/* how the last lookup went, no data is OK */
+		typedef enum {
+			STATUS_OK,
+			STATUS_NXDOMAIN,
+			STATUS_SERVFAIL,
+			STATUS_TIMEOUT,
+			STATUS_ERROR,
+		} Status;
+
 		Resolver();
 		~Resolver();
 
+		bool SetServer(const std::string& address, unsigned short port);
 		bool Lookup(const std::string& domain, RecordType recordType, std::vector<std::string>& result);
+		Status GetLastStatus() const { return m_status; }
+		/* bytes of the last answer (0 if unknown) */
+		size_t GetLastSize() const { return m_size; }
 		int GetLastError() const {
 #ifdef __WIN32__
 			return -1;
@@ -66,6 +80,8 @@ class Resolver
 #endif
 		}
 	private:
+		Status m_status;
+		size_t m_size;
 #ifdef __WIN32__
 		HINSTANCE m_hDnsInst;
 		LPDNSRECORDLISTFREE m_lpfnDnsRecordListFree;
@@ -0,0 +1,102 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "result.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+using std::string;
+
+static const char* MAGIC = "SMTPPING-RESULT";
+
+const string& Result::Get(const string& key) const
+{
+	static const string none;
+	for (size_t i = 0; i < config.size(); ++i)
+		if (config[i].first == key)
+			return config[i].second;
+	return none;
+}
+
+bool Result::Save(const char* path, const char* version) const
+{
+	std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+	ofs << MAGIC << " " << version << " " << FORMAT << "\n";
+	for (size_t i = 0; i < config.size(); ++i)
+		ofs << config[i].first << ": " << config[i].second << "\n";
+	char buf[64];
+	snprintf(buf, sizeof buf, "elapsed: %.3lf\n\n", elapsed);
+	ofs << buf;
+	ofs << stats.Format();
+	return ofs.good();
+}
+
+bool Result::Load(const char* path, string& error)
+{
+	std::ifstream ifs(path, std::ios::binary);
+	if (!ifs.good())
+	{
+		error = "could not be opened";
+		return false;
+	}
+
+	string line;
+	char magic[32], saved[32];
+	int format = 0;
+	int fields = std::getline(ifs, line) ? sscanf(line.c_str(),
+			"%31s %31s %d", magic, saved, &format) : 0;
+	if (fields < 2 || strcmp(magic, MAGIC) != 0)
+	{
+		error = "not a result file";
+		return false;
+	}
+	if (fields != 3 || format != FORMAT)
+	{
+		char buf[128];
+		snprintf(buf, sizeof buf, "format %d (saved by %s), this build "
+				"reads format %d", format, saved, (int)FORMAT);
+		error = buf;
+		return false;
+	}
+
+	config.clear();
+	elapsed = 0;
+	while (std::getline(ifs, line) && !line.empty())
+	{
+		size_t colon = line.find(": ");
+		if (colon == string::npos)
+		{
+			error = "invalid header: " + line;
+			return false;
+		}
+		if (line.compare(0, colon, "elapsed") == 0)
+			elapsed = strtod(line.c_str() + colon + 2, NULL);
+		else
+			config.push_back(std::make_pair(line.substr(0, colon),
+						line.substr(colon + 2)));
+	}
+	std::stringstream text;
+	text << ifs.rdbuf();
+	return stats.Parse(text.str(), error);
+}
@@ -0,0 +1,54 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _RESULT_HPP_
+#define _RESULT_HPP_
+
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
+
+/*
+ * Result: the statistics of a run and how it was run, saved with --save
+ *         and compared with --compare
+ *
+ * Results are text, so that they can be compared on another platform or
+ * by another build (that reads the same FORMAT):
+ *
+ *   SMTPPING-RESULT <version> <format>
+ *   <key>: <value>    (configuration, one per line)
+ *                     (an empty line)
+ *   <statistics>      (see Statistics::Format)
+ */
+struct Result
+{
+	enum { FORMAT = 1 };
+
+	std::vector<std::pair<std::string, std::string> > config;
+	double elapsed;		/* s */
+	Statistics stats;
+
+	const std::string& Get(const std::string& key) const;
+	bool Save(const char* path, const char* version) const;
+	bool Load(const char* path, std::string& error);
+};
+
+#endif
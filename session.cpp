@@ -0,0 +1,1127 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "session.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef __WIN32__
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include "uring.hpp"
+
+/* user values of the read of a reply and of a connect, sends are
+   numbered from 1 */
+static const uint64_t READ_OP = (uint64_t)-1;
+static const uint64_t CONNECT_OP = (uint64_t)-2;
+#endif
+
+using std::string;
+using std::vector;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+const char* SMTPTransferName[TRANSFER_MAX] = {
+	"DATA",
+	"DATA+PIPELINING",
+	"BDAT",
+	"BDAT+PIPELINING",
+};
+
+const char* SMTPPhaseName[PHASE_MAX] = {
+	"connect",
+	"banner",
+	"helo",
+	"mailfrom",
+	"rcptto",
+	"data",
+	"datasent",
+	"quit",
+};
+
+/*
+ * high resolution timers (should return ms with 2 decimals)
+ */
+#ifdef __WIN32__
+#include <windows.h>
+
+double PCFreq = 0.0;
+__int64 CounterStart = 0;
+
+/* initialize counters */
+void StartCounter()
+{
+	LARGE_INTEGER li;
+	if(!QueryPerformanceFrequency(&li))
+		return;
+
+	PCFreq = double(li.QuadPart)/1000.0;
+
+	QueryPerformanceCounter(&li);
+	CounterStart = li.QuadPart;
+}
+
+/* GetHighResTime(): should be ported */
+double GetHighResTime()
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	return double(li.QuadPart-CounterStart)/PCFreq;
+}
+
+#else
+#include <sys/time.h>
+
+/* GetHighResTime(): should be ported */
+double GetHighResTime()
+{
+	struct timeval tv;
+	if(gettimeofday(&tv, NULL) != 0)
+		return 0;
+	return (tv.tv_sec * 1000.0) + (tv.tv_usec / 1000.0);
+}
+#endif
+
+Session::Session(IOUring* ring, bool lmtp)
+: m_socket(-1), m_init(0), m_start(0), m_failed(PHASE_MAX), m_reply(0),
+  m_transfer(TRANSFER_DATA), m_ring(ring), m_rbuf(m_buffer),
+  m_rsize(sizeof m_buffer), m_rpos(0), m_rlen(0), m_lmtp(lmtp),
+  m_tcp(false), m_family(AF_UNSPEC)
+{
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		m_time[i] = -1;
+#ifdef HAVE_IO_URING
+	if (m_ring)
+	{
+		m_rbuf = m_ring->GetBuffer();
+		m_rsize = IOUring::BUFFER_SIZE;
+	}
+#endif
+}
+
+Session::~Session()
+{
+	Close();
+}
+
+void Session::Close()
+{
+#ifdef HAVE_IO_URING
+	/* queued sends use the socket and our memory, let them finish */
+	if (m_ring && !m_sends.empty())
+		Complete(false);
+#endif
+	if (m_socket != -1)
+	{
+		close(m_socket);
+		m_socket = -1;
+		m_counters.syscalls++;
+	}
+}
+
+void Session::Mark(SMTPPhase phase)
+{
+	m_time[phase] = GetHighResTime();
+	if (phase == PHASE_CONNECT)
+		m_start = m_time[phase];
+}
+
+/*
+ * Reset: forget the outcome, and the timings from phase on
+ */
+void Session::Reset(SMTPPhase from)
+{
+	for (size_t i = from; i < PHASE_MAX; ++i)
+		m_time[i] = -1;
+	m_failed = PHASE_MAX;
+	m_error.clear();
+	m_reply = 0;
+	m_chunk_time.clear();
+	m_rcpt_time.clear();
+}
+
+/*
+ * Begin: start another transaction on an open connection, its phases are
+ *        timed from now
+ */
+void Session::Begin()
+{
+	Reset(PHASE_MAILFROM);
+	m_start = GetHighResTime();
+}
+
+bool Session::Fail(SMTPPhase phase, const string& error)
+{
+	/* the first failure is the one to report */
+	if (m_failed == PHASE_MAX)
+	{
+		m_failed = phase;
+		m_error = error;
+	}
+	Close();
+	return false;
+}
+
+/*
+ * GetTime: elapsed ms for phase, or -1 if it was never reached
+ */
+double Session::GetTime(SMTPPhase phase) const
+{
+	if (m_time[phase] < 0)
+		return -1;
+	if (phase == PHASE_CONNECT)
+		return m_time[PHASE_CONNECT] - m_init;
+	if (phase >= PHASE_MAILFROM)
+		return m_time[phase] - m_start;
+	return m_time[phase] - m_time[PHASE_CONNECT];
+}
+
+double Session::GetTotalTime() const
+{
+	if (m_time[PHASE_QUIT] < 0)
+		return -1;
+	return m_time[PHASE_QUIT] - m_init;
+}
+
+bool SocketOptions::Any() const
+{
+	return nodelay || sndbuf || rcvbuf || fastopen || quickack || linger;
+}
+
+string SocketOptions::Describe() const
+{
+	if (!Any())
+		return "defaults";
+	string opts;
+	if (nodelay)
+		opts += ", nodelay";
+	if (sndbuf)
+		opts += ", sndbuf " + std::to_string(sndbuf);
+	if (rcvbuf)
+		opts += ", rcvbuf " + std::to_string(rcvbuf);
+	if (fastopen)
+		opts += ", fastopen";
+	if (quickack)
+		opts += ", quickack";
+	if (linger)
+		opts += ", linger 0";
+	return opts.substr(2);
+}
+
+/*
+ * Parse: add one extension line of an EHLO reply (eg. "SIZE 10240000")
+ */
+void SMTPCapabilities::Parse(const string& line)
+{
+	string keyword = line.substr(0, line.find(' '));
+	for (size_t c = 0; c < keyword.size(); ++c)
+		keyword[c] = toupper(keyword[c]);
+	if (keyword == "SIZE")
+	{
+		size = true;
+		if (keyword.size() < line.size())
+			size_limit = strtoull(line.c_str() + keyword.size() + 1, NULL, 10);
+	} else if (keyword == "PIPELINING")
+		pipelining = true;
+	else if (keyword == "CHUNKING")
+		chunking = true;
+	else if (keyword == "8BITMIME")
+		eightbitmime = true;
+	else if (keyword == "STARTTLS")
+		starttls = true;
+}
+
+/*
+ * Describe: the known extensions, eg. "ESMTP SIZE 10240000 PIPELINING"
+ */
+string SMTPCapabilities::Describe() const
+{
+	if (!esmtp)
+		return ehlo ? "SMTP (EHLO rejected)" : "SMTP";
+	string caps = "ESMTP";
+	if (size)
+		caps += size_limit ? " SIZE " + std::to_string(size_limit) : " SIZE";
+	if (pipelining)
+		caps += " PIPELINING";
+	if (chunking)
+		caps += " CHUNKING";
+	if (eightbitmime)
+		caps += " 8BITMIME";
+	if (starttls)
+		caps += " STARTTLS";
+	return caps;
+}
+
+/*
+ * ReadLine: read a smtp line and return status code, the text of each
+ *           line of a multi-line response is added to lines
+ *           return false on disconnect
+ */
+bool Session::ReadLine(size_t& ret, vector<string>* lines)
+{
+	string cmd;
+	for (;;)
+	{
+		if (m_rpos == m_rlen && !Fill())
+			return false;
+		const char* eol = (const char*)memchr(m_rbuf + m_rpos, '\n',
+				m_rlen - m_rpos);
+		size_t n = eol ? eol - (m_rbuf + m_rpos) + 1 : m_rlen - m_rpos;
+		cmd.append(m_rbuf + m_rpos, n);
+		m_rpos += n;
+		if (!eol)
+			continue;
+
+		if (debug)
+			fprintf(stderr, "response %s", cmd.c_str());
+		if (lines && cmd.size() > 4)
+			lines->push_back(cmd.substr(4,
+				cmd.find_last_not_of("\r\n") - 3));
+		/* support multi-line responses */
+		if (cmd.size() > 4 && cmd[3] == ' ')
+		{
+			ret = strtoul(cmd.substr(0, 3).c_str(), NULL, 10);
+			return true;
+		} else
+			cmd.clear();
+	}
+}
+
+/*
+ * Fill: read more replies into the buffer (instead of a byte at a time),
+ *       with io_uring the queued commands are submitted along with the read
+ */
+bool Session::Fill()
+{
+	m_rpos = m_rlen = 0;
+#ifdef HAVE_IO_URING
+	if (m_ring)
+	{
+		m_ring->Read(m_socket, READ_OP);
+		if (!Complete(true))
+			return false;
+		QuickAck();
+		return true;
+	}
+#endif
+	int r = recv(m_socket, m_rbuf, m_rsize, MSG_NOSIGNAL);
+	m_counters.syscalls++;
+	if (r <= 0)
+		return false;
+	m_rlen = r;
+	m_counters.received += r;
+	QuickAck();
+	return true;
+}
+
+/*
+ * Tune: apply the socket options (before connecting)
+ */
+bool Session::Tune(int family)
+{
+	int on = 1;
+	m_tcp = family == AF_INET || family == AF_INET6;
+	if (m_sockopts.sndbuf && SetOption(SOL_SOCKET, SO_SNDBUF,
+				&m_sockopts.sndbuf, sizeof(int)) != 0)
+		return Fail(PHASE_CONNECT, "setsockopt(SO_SNDBUF) failed");
+	if (m_sockopts.rcvbuf && SetOption(SOL_SOCKET, SO_RCVBUF,
+				&m_sockopts.rcvbuf, sizeof(int)) != 0)
+		return Fail(PHASE_CONNECT, "setsockopt(SO_RCVBUF) failed");
+	if (m_sockopts.linger)
+	{
+		struct linger l = { 1, 0 };
+		if (SetOption(SOL_SOCKET, SO_LINGER, &l, sizeof l) != 0)
+			return Fail(PHASE_CONNECT, "setsockopt(SO_LINGER) failed");
+	}
+	if (!m_tcp)
+		return true;
+	if (m_sockopts.nodelay && SetOption(IPPROTO_TCP, TCP_NODELAY,
+				&on, sizeof on) != 0)
+		return Fail(PHASE_CONNECT, "setsockopt(TCP_NODELAY) failed");
+	if (m_sockopts.fastopen)
+	{
+#ifdef TCP_FASTOPEN_CONNECT
+		if (SetOption(IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+					&on, sizeof on) != 0)
+			return Fail(PHASE_CONNECT,
+					"setsockopt(TCP_FASTOPEN_CONNECT) failed");
+#else
+		return Fail(PHASE_CONNECT, "TCP_FASTOPEN_CONNECT not supported");
+#endif
+	}
+#ifndef TCP_QUICKACK
+	if (m_sockopts.quickack)
+		return Fail(PHASE_CONNECT, "TCP_QUICKACK not supported");
+#endif
+	return true;
+}
+
+/*
+ * SetOption: setsockopt on the session's socket
+ */
+int Session::SetOption(int level, int name, const void* value,
+		socklen_t size)
+{
+	m_counters.syscalls++;
+	return setsockopt(m_socket, level, name, (const char*)value, size);
+}
+
+/*
+ * QuickAck: ack the next segment at once, TCP_QUICKACK doesn't stick so
+ *           it's set again after every read
+ */
+void Session::QuickAck()
+{
+#ifdef TCP_QUICKACK
+	int on = 1;
+	if (m_sockopts.quickack && m_tcp)
+		SetOption(IPPROTO_TCP, TCP_QUICKACK, &on, sizeof on);
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Complete: submit what is queued on the ring and wait for all of it,
+ *           false if a send or the read failed
+ */
+bool Session::Complete(bool read)
+{
+	unsigned int pending = m_sends.size() + (read ? 1 : 0);
+	bool ok = m_ring->Submit(pending);
+	m_counters.syscalls++;
+	while (ok && pending > 0)
+	{
+		uint64_t user;
+		int result;
+		while (pending > 0 && m_ring->Reap(user, result))
+		{
+			pending--;
+			if (user == READ_OP)
+			{
+				m_rlen = result > 0 ? result : 0;
+				m_counters.received += m_rlen;
+			} else if (result == (int)m_sends[user - 1].size)
+				m_counters.sent += result;
+			else if (m_failed == PHASE_MAX)
+			{
+				m_reply = 0;
+				m_failed = m_sends[user - 1].phase;
+				m_error = m_sends[user - 1].error;
+			}
+		}
+		if (pending > 0)
+		{
+			ok = m_ring->Submit(pending);
+			m_counters.syscalls++;
+		}
+	}
+	m_sends.clear();
+	m_out.clear();
+	if (!ok || m_failed != PHASE_MAX)
+	{
+		Fail(m_failed, ok ? m_error : "io_uring: submit failed");
+		return false;
+	}
+	return !read || m_rlen > 0;
+}
+#endif
+
+/*
+ * Readable: if a reply can be read without blocking
+ */
+bool Session::Readable()
+{
+	if (m_rpos < m_rlen)
+		return true;
+#ifdef HAVE_IO_URING
+	/* queued chunks can't be answered before they are submitted (if that
+	   fails, reading tells) */
+	if (m_ring && !m_sends.empty() && !Complete(false))
+		return true;
+#endif
+	m_counters.syscalls++;
+#ifdef __WIN32__
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(m_socket, &fds);
+	struct timeval tv = { 0, 0 };
+	return select(m_socket + 1, &fds, NULL, NULL, &tv) > 0;
+#else
+	struct pollfd fd = { m_socket, POLLIN, 0 };
+	return poll(&fd, 1, 0) > 0;
+#endif
+}
+
+bool Session::Send(SMTPPhase phase, const string& cmd, int flags,
+		const char* error)
+{
+#ifdef HAVE_IO_URING
+	/* keep a copy until it's submitted */
+	if (m_ring)
+	{
+		m_out.push_back(cmd);
+		return Send(phase, m_out.back().c_str(), cmd.size(), flags, error);
+	}
+#endif
+	return Send(phase, cmd.c_str(), cmd.size(), flags, error);
+}
+
+/*
+ * Send: send data, with io_uring it's only queued (so data must stay valid)
+ *       until the reply is read
+ */
+bool Session::Send(SMTPPhase phase, const char* data, size_t size, int flags,
+		const char* error)
+{
+#ifdef HAVE_IO_URING
+	if (m_ring)
+	{
+		PendingSend pending = { phase, size, error };
+		m_sends.push_back(pending);
+		m_ring->Send(m_socket, data, size, flags, m_sends.size());
+		return true;
+	}
+#endif
+	m_counters.syscalls++;
+	if (send(m_socket, data, size, flags | MSG_NOSIGNAL) != (int)size)
+	{
+		m_reply = 0;
+		return Fail(phase, error);
+	}
+	m_counters.sent += size;
+	return true;
+}
+
+/*
+ * Command: send cmd and expect a reply of class expect (0 accepts any)
+ */
+bool Session::Command(SMTPPhase phase, const string& cmd, const char* name,
+		size_t expect)
+{
+	return Send(phase, cmd) && Reply(phase, name, expect);
+}
+
+/*
+ * Reply: read the reply to a command sent earlier
+ */
+bool Session::Reply(SMTPPhase phase, const char* name, size_t expect)
+{
+	m_reply = 0;
+	if (!ReadLine(m_reply) || (expect && m_reply / 100 != expect))
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, "recv: %s failed (%zu)", name, m_reply);
+		return Fail(phase, buf);
+	}
+	Mark(phase);
+	return true;
+}
+
+bool Session::Connect(const struct addrinfo* res, const struct addrinfo* bindIP,
+		const char* address)
+{
+	/* a session may be reconnected after a failure */
+	Close();
+	Reset(PHASE_CONNECT);
+	m_rpos = m_rlen = 0;
+	m_family = AF_UNSPEC;
+
+	m_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	m_counters.syscalls++;
+	if (m_socket == -1)
+		return Fail(PHASE_CONNECT, "socket() failed");
+	if (!Tune(res->ai_family))
+		return false;
+
+	if (bindIP)
+	{
+		m_counters.syscalls++;
+		if (bind(m_socket, bindIP->ai_addr, bindIP->ai_addrlen) != 0)
+			return Fail(PHASE_CONNECT, "bind() failed");
+	}
+
+	/* initiate counters on windows */
+#ifdef __WIN32__
+	StartCounter();
+#endif
+
+	/* start up time */
+	m_init = GetHighResTime();
+
+	/* connect */
+#ifdef HAVE_IO_URING
+	if (m_ring)
+	{
+		/* submitted along with the close of the previous session */
+		m_ring->Connect(m_socket, res->ai_addr, res->ai_addrlen, CONNECT_OP);
+		uint64_t user;
+		int result = -1;
+		bool ok = true;
+		do
+		{
+			ok = m_ring->Submit(1);
+			m_counters.syscalls++;
+		} while (ok && !m_ring->Reap(user, result));
+		if (!ok || result != 0)
+			return Fail(PHASE_CONNECT, string("connect() failed ") + address);
+	} else
+#endif
+	{
+		m_counters.syscalls++;
+		if (connect(m_socket, res->ai_addr, res->ai_addrlen) != 0)
+			return Fail(PHASE_CONNECT, string("connect() failed ") + address);
+	}
+	m_family = res->ai_family;
+	Mark(PHASE_CONNECT);
+	return true;
+}
+
+/*
+ * SetBlocking: switch a socket between blocking and non-blocking
+ */
+static bool SetBlocking(int s, bool blocking)
+{
+#ifdef __WIN32__
+	u_long mode = blocking ? 0 : 1;
+	return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	return flags != -1 && fcntl(s, F_SETFL, blocking ?
+			flags & ~O_NONBLOCK : flags | O_NONBLOCK) == 0;
+#endif
+}
+
+/*
+ * Attempt: start a non-blocking connect to res for Race, the socket (that
+ *          may have connected already) or -1 if it failed
+ */
+int Session::Attempt(const struct addrinfo* res, const struct addrinfo* bindIP,
+		const char* address, bool& connected)
+{
+	m_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	m_counters.syscalls++;
+	bool ok = m_socket != -1 || Fail(PHASE_CONNECT, "socket() failed");
+	ok = ok && Tune(res->ai_family);
+	if (ok)
+		m_counters.syscalls += 2;
+	ok = ok && (SetBlocking(m_socket, false) ||
+			Fail(PHASE_CONNECT, "fcntl() failed"));
+	if (ok && bindIP)
+	{
+		m_counters.syscalls++;
+		if (bind(m_socket, bindIP->ai_addr, bindIP->ai_addrlen) != 0)
+			ok = Fail(PHASE_CONNECT, "bind() failed");
+	}
+	if (!ok)
+		return -1;
+
+	m_counters.syscalls++;
+	connected = connect(m_socket, res->ai_addr, res->ai_addrlen) == 0;
+#ifdef __WIN32__
+	if (!connected && WSAGetLastError() != WSAEWOULDBLOCK)
+#else
+	if (!connected && errno != EINPROGRESS)
+#endif
+	{
+		Fail(PHASE_CONNECT, string("connect() failed ") + address);
+		return -1;
+	}
+	int s = m_socket;
+	m_socket = -1;
+	return s;
+}
+
+/*
+ * Race: connect to the first of candidates to answer (RFC 8305 Happy
+ *       Eyeballs), starting the next attempt after delay ms, or as soon as
+ *       the others have failed, while none has connected; the connect time
+ *       is from the first attempt
+ */
+bool Session::Race(const vector<const struct addrinfo*>& candidates,
+		const struct addrinfo* bindIP, double delay, const char* address)
+{
+	Close();
+	Reset(PHASE_CONNECT);
+	m_rpos = m_rlen = 0;
+	m_family = AF_UNSPEC;
+
+	/* initiate counters on windows */
+#ifdef __WIN32__
+	StartCounter();
+#endif
+
+	/* start up time */
+	m_init = GetHighResTime();
+
+	vector<int> sockets;	/* of each attempt, -1 once it failed */
+	size_t next = 0, pending = 0;
+	int winner = -1;
+	double due = m_init;
+	while (winner == -1 && (next < candidates.size() || pending))
+	{
+		double now = GetHighResTime();
+		if (next < candidates.size() && (now >= due || !pending))
+		{
+			bool connected = false;
+			int s = Attempt(candidates[next++], bindIP, address,
+					connected);
+			sockets.push_back(s);
+			due = now + delay;
+			if (s != -1 && connected)
+				winner = sockets.size() - 1;
+			else if (s != -1)
+				pending++;
+			continue;
+		}
+
+		/* wait for an attempt to finish, or the next to be due; poll()
+		   where an fd_set only holds descriptors below FD_SETSIZE */
+		double wait = next < candidates.size() ?
+			(due > now ? due - now : 0) : -1;
+		vector<size_t> done;
+#ifdef __WIN32__
+		fd_set wfds, efds;
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		for (size_t i = 0; i < sockets.size(); ++i)
+			if (sockets[i] != -1)
+			{
+				FD_SET(sockets[i], &wfds);
+				FD_SET(sockets[i], &efds);
+			}
+		struct timeval tv, *timeout = NULL;
+		if (wait >= 0)
+		{
+			tv.tv_sec = (long)(wait / 1000);
+			tv.tv_usec = (long)((wait - tv.tv_sec * 1000.0) * 1000);
+			timeout = &tv;
+		}
+		m_counters.syscalls++;
+		if (select(0, NULL, &wfds, &efds, timeout) < 0)
+			break;
+		for (size_t i = 0; i < sockets.size(); ++i)
+			if (sockets[i] != -1 && (FD_ISSET(sockets[i], &wfds) ||
+						FD_ISSET(sockets[i], &efds)))
+				done.push_back(i);
+#else
+		vector<struct pollfd> fds;
+		vector<size_t> index;
+		for (size_t i = 0; i < sockets.size(); ++i)
+			if (sockets[i] != -1)
+			{
+				struct pollfd fd = { sockets[i], POLLOUT, 0 };
+				fds.push_back(fd);
+				index.push_back(i);
+			}
+		int timeout = -1;
+		if (wait >= 0)
+		{
+			timeout = (int)wait;
+			if (timeout < wait)
+				timeout++;
+		}
+		m_counters.syscalls++;
+		if (poll(&fds[0], fds.size(), timeout) < 0)
+			break;
+		for (size_t f = 0; f < fds.size(); ++f)
+			if (fds[f].revents)
+				done.push_back(index[f]);
+#endif
+		for (size_t d = 0; d < done.size(); ++d)
+		{
+			size_t i = done[d];
+			int error = 0;
+			socklen_t size = sizeof error;
+			m_counters.syscalls++;
+			if (getsockopt(sockets[i], SOL_SOCKET, SO_ERROR, (char*)&error,
+						&size) == 0 && error == 0)
+			{
+				winner = i;
+				break;
+			}
+			close(sockets[i]);
+			m_counters.syscalls++;
+			sockets[i] = -1;
+			pending--;
+			Fail(PHASE_CONNECT, string("connect() failed ") + address);
+		}
+	}
+
+	/* the others are abandoned */
+	for (size_t i = 0; i < sockets.size(); ++i)
+		if (sockets[i] != -1 && (int)i != winner)
+		{
+			close(sockets[i]);
+			m_counters.syscalls++;
+		}
+	if (winner == -1)
+		return Fail(PHASE_CONNECT, string("connect() failed ") + address);
+	m_socket = sockets[winner];
+	m_counters.syscalls += 2;
+	if (!SetBlocking(m_socket, true))
+		return Fail(PHASE_CONNECT, "fcntl() failed");
+
+	/* earlier attempts may have failed, the race didn't */
+	m_failed = PHASE_MAX;
+	m_error.clear();
+	m_tcp = true;
+	m_family = candidates[winner]->ai_family;
+	Mark(PHASE_CONNECT);
+	return true;
+}
+
+bool Session::Greet(const char* helo, bool ehlo)
+{
+	/*
+	 * With TCP Fast Open the greeting is the data of the SYN, so it's sent
+	 * before the banner (servers that enforce waiting for it will reject
+	 * the session)
+	 */
+	string greeting = string(m_lmtp ? "LHLO " : ehlo ? "EHLO " : "HELO ") +
+		helo + "\r\n";
+	bool sent = m_tcp && m_sockopts.fastopen;
+	if (sent && !Send(PHASE_HELO, greeting))
+		return false;
+
+	/*
+	 * < SMTP Banner
+	 */
+	m_reply = 0;
+	if (!ReadLine(m_reply) || m_reply / 100 != 2)
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, "recv: BANNER failed (%zu)", m_reply);
+		return Fail(PHASE_BANNER, buf);
+	}
+	Mark(PHASE_BANNER);
+
+	m_caps = SMTPCapabilities();
+	if (m_lmtp)
+	{
+		/*
+		 * > LHLO helo
+		 * < 250-greeting
+		 * < 250 extension (one per line)
+		 */
+		vector<string> lines;
+		m_caps.ehlo = true;
+		if (!sent && !Send(PHASE_HELO, greeting))
+			return false;
+		m_reply = 0;
+		if (!ReadLine(m_reply, &lines) || m_reply / 100 != 2)
+		{
+			char buf[64];
+			snprintf(buf, sizeof buf, "recv: LHLO failed (%zu)", m_reply);
+			return Fail(PHASE_HELO, buf);
+		}
+		m_caps.esmtp = true;
+		for (size_t i = 1; i < lines.size(); ++i)
+			m_caps.Parse(lines[i]);
+		Mark(PHASE_HELO);
+		return true;
+	}
+	if (ehlo)
+	{
+		/*
+		 * > EHLO helo
+		 * < 250-greeting
+		 * < 250 extension (one per line)
+		 */
+		vector<string> lines;
+		m_caps.ehlo = true;
+		if (!sent && !Send(PHASE_HELO, greeting))
+			return false;
+		m_reply = 0;
+		if (!ReadLine(m_reply, &lines) ||
+				(m_reply / 100 != 2 && m_reply / 100 != 5))
+		{
+			char buf[64];
+			snprintf(buf, sizeof buf, "recv: EHLO failed (%zu)", m_reply);
+			return Fail(PHASE_HELO, buf);
+		}
+		if (m_reply / 100 == 2)
+		{
+			m_caps.esmtp = true;
+			for (size_t i = 1; i < lines.size(); ++i)
+				m_caps.Parse(lines[i]);
+			Mark(PHASE_HELO);
+			return true;
+		}
+		/* EHLO rejected, fall back on HELO */
+		sent = false;
+	}
+
+	/*
+	 * > HELO helo
+	 * < 250 OK
+	 */
+	if (sent)
+		return Reply(PHASE_HELO, "HELO", 2);
+	return Command(PHASE_HELO, string("HELO ") + helo + "\r\n", "HELO", 2);
+}
+
+bool Session::Transaction(const char* from, const vector<string>& rcpts,
+		const string& data, SMTPTransfer transfer, size_t chunk_size)
+{
+	bool bdat = transfer == TRANSFER_BDAT ||
+		transfer == TRANSFER_BDAT_PIPELINING;
+	bool pipelining = transfer == TRANSFER_DATA_PIPELINING ||
+		transfer == TRANSFER_BDAT_PIPELINING;
+	m_transfer = transfer;
+	/* -C sends BDAT whether or not CHUNKING was announced */
+	if (pipelining && !m_caps.pipelining)
+		return Fail(PHASE_MAILFROM, "PIPELINING not supported");
+
+	string mail = string("MAIL FROM: <") + from + ">";
+	if (m_caps.size)
+		mail += " SIZE=" + std::to_string(data.size());
+	mail += "\r\n";
+
+	if (pipelining)
+	{
+		/*
+		 * > MAIL FROM: <address>
+		 * > RCPT TO: <address> (one per recipient)
+		 * > DATA               (unless chunking)
+		 * < 250 OK             (one reply per command)
+		 */
+		string cmds = mail;
+		for (vector<string>::const_iterator i = rcpts.begin();
+				i != rcpts.end(); ++i)
+			cmds += "RCPT TO: <" + *i + ">\r\n";
+		if (!bdat)
+			cmds += "DATA\r\n";
+		if (!Send(PHASE_MAILFROM, cmds) ||
+				!Reply(PHASE_MAILFROM, "MAIL FROM", 2))
+			return false;
+		for (size_t i = 0; i < rcpts.size(); ++i)
+			if (!Reply(PHASE_RCPTTO, "RCPT TO", 2))
+				return false;
+		if (!bdat && !Reply(PHASE_DATA, "DATA", 3))
+			return false;
+	} else
+	{
+		/*
+		 * > MAIL FROM: <address>
+		 * < 250 OK
+		 */
+		if (!Command(PHASE_MAILFROM, mail, "MAIL FROM", 2))
+			return false;
+
+		/*
+		 * > RCPT TO: <address>
+		 * < 250 OK
+		 */
+		for (vector<string>::const_iterator i = rcpts.begin(); i != rcpts.end(); ++i)
+			if (!Command(PHASE_RCPTTO, "RCPT TO: <" + *i + ">\r\n",
+						"RCPT TO", 2))
+				return false;
+
+		/*
+		 * > DATA
+		 * < 354 Feed me
+		 */
+		if (!bdat && !Command(PHASE_DATA, "DATA\r\n", "DATA", 3))
+			return false;
+	}
+
+	if (bdat)
+	{
+		Mark(PHASE_DATA);
+		return Chunks(data, chunk_size, pipelining, rcpts.size());
+	}
+
+	if (m_lmtp)
+	{
+		/*
+		 * > data...
+		 * > .
+		 * < ??? Mkay (one per recipient)
+		 */
+		if (!Send(PHASE_DATASENT, data.c_str(), data.size(), MSG_MORE) ||
+				!Send(PHASE_DATASENT, ".\r\n"))
+			return false;
+		m_rcpt_time.clear();
+		if (!Delivered(rcpts.size(), GetHighResTime()))
+			return false;
+		Mark(PHASE_DATASENT);
+		return true;
+	}
+
+	/*
+	 * > data...
+	 * > .
+	 * < ??? Mkay
+	 */
+	return Send(PHASE_DATASENT, data.c_str(), data.size(), MSG_MORE) &&
+		Command(PHASE_DATASENT, ".\r\n", "EOM", 0);
+}
+
+/*
+ * Delivered: read the LMTP replies of the remaining rcpts recipients after
+ *            the end of the message (sent at sent), timing each delivered
+ *            one. Like a refused RCPT TO, a recipient that isn't delivered
+ *            (or refused, the reply of an earlier one) fails the
+ *            transaction with its reply, once all replies have been read
+ */
+bool Session::Delivered(size_t rcpts, double sent, size_t refused)
+{
+	while (rcpts-- > 0)
+	{
+		m_reply = 0;
+		if (!ReadLine(m_reply))
+		{
+			char buf[64];
+			snprintf(buf, sizeof buf, "recv: EOM failed (%zu)", m_reply);
+			return Fail(PHASE_DATASENT, buf);
+		}
+		if (m_reply / 100 == 2)
+			m_rcpt_time.push_back(GetHighResTime() - sent);
+		else if (!refused)
+			refused = m_reply;
+	}
+	if (refused)
+	{
+		char buf[64];
+		m_reply = refused;
+		snprintf(buf, sizeof buf, "recv: EOM failed (%zu)", m_reply);
+		return Fail(PHASE_DATASENT, buf);
+	}
+	return true;
+}
+
+/*
+ * Chunks: send data in BDAT chunks of chunk_size (0 is all of it), straight
+ *         from data without copying it. When pipelining up to
+ *         PIPELINE_WINDOW chunks are sent before their replies are read,
+ *         otherwise each chunk waits for its reply. With LMTP the last
+ *         chunk gets a reply per recipient (of rcpts)
+ */
+bool Session::Chunks(const string& data, size_t chunk_size, bool pipelining,
+		size_t rcpts)
+{
+	if (chunk_size == 0 || chunk_size > data.size())
+		chunk_size = data.size();
+	size_t window = pipelining ? PIPELINE_WINDOW : 1;
+
+	vector<double> sent;	/* when each chunk was sent */
+	size_t offset = 0;
+	m_chunk_time.clear();
+	do
+	{
+		/*
+		 * > BDAT size [LAST]
+		 * > chunk...
+		 */
+		size_t size = data.size() - offset < chunk_size ?
+			data.size() - offset : chunk_size;
+		bool last = offset + size == data.size();
+		string cmd = "BDAT " + std::to_string(size) +
+			(last ? " LAST" : "") + "\r\n";
+		if (!Send(PHASE_DATASENT, cmd, size ? MSG_MORE : 0) ||
+				(size && !Send(PHASE_DATASENT, data.c_str() + offset, size, 0)))
+			return false;
+		sent.push_back(GetHighResTime());
+		offset += size;
+
+		/*
+		 * < 250 OK (one per chunk, ??? Mkay for the last)
+		 */
+		while (m_chunk_time.size() < sent.size() &&
+				(last || sent.size() - m_chunk_time.size() >= window ||
+				 Readable()))
+		{
+			bool eom = last && m_chunk_time.size() + 1 == sent.size();
+			m_reply = 0;
+			if (!ReadLine(m_reply) || (!eom && m_reply / 100 != 2))
+			{
+				char buf[64];
+				snprintf(buf, sizeof buf, "recv: %s failed (%zu)",
+						eom ? "EOM" : "BDAT", m_reply);
+				return Fail(PHASE_DATASENT, buf);
+			}
+			m_chunk_time.push_back(GetHighResTime() -
+					sent[m_chunk_time.size()]);
+		}
+	} while (offset < data.size());
+
+	/* the last chunk's reply was the first recipient's */
+	if (m_lmtp)
+	{
+		size_t refused = m_reply / 100 == 2 ? 0 : m_reply;
+		m_rcpt_time.clear();
+		if (!refused)
+			m_rcpt_time.push_back(m_chunk_time.back());
+		if (!Delivered(rcpts > 0 ? rcpts - 1 : 0, sent.back(), refused))
+			return false;
+	}
+	Mark(PHASE_DATASENT);
+	return true;
+}
+
+bool Session::Quit()
+{
+	/*
+	 * > QUIT
+	 * < ??? Mkay
+	 */
+	if (!Send(PHASE_QUIT, "QUIT\r\n", 0, "send: QUIT failed"))
+		return false;
+	m_reply = 0;
+	if (!ReadLine(m_reply))
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, "recv: QUIT failed (%zu)", m_reply);
+		return Fail(PHASE_QUIT, buf);
+	}
+	Mark(PHASE_QUIT);
+
+#ifdef HAVE_IO_URING
+	/* closed along with whatever the ring submits next */
+	if (m_ring)
+	{
+		m_ring->Close(m_socket);
+		m_socket = -1;
+		return true;
+	}
+#endif
+	/* with SO_LINGER 0 closing resets the connection, no TIME_WAIT */
+	if (!m_sockopts.linger)
+	{
+		shutdown(m_socket, 2);
+		m_counters.syscalls++;
+	}
+	Close();
+	return true;
+}
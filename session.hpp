@@ -0,0 +1,244 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _SESSION_HPP_
+#define _SESSION_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __WIN32__
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+extern bool debug;
+
+/*
+ * high resolution timers (should return ms with 2 decimals)
+ */
+#ifdef __WIN32__
+void StartCounter();
+#endif
+double GetHighResTime();
+
+/*
+ * SMTP transaction phases, connect is timed from the start of the
+ * connection attempt and the others from when the connection was made
+ */
+typedef enum {
+	PHASE_CONNECT,
+	PHASE_BANNER,
+	PHASE_HELO,
+	PHASE_MAILFROM,
+	PHASE_RCPTTO,
+	PHASE_DATA,
+	PHASE_DATASENT,
+	PHASE_QUIT,
+	PHASE_MAX
+} SMTPPhase;
+
+extern const char* SMTPPhaseName[PHASE_MAX];
+
+/*
+ * How the message is transferred, pipelining covers MAIL FROM, RCPT TO
+ * and DATA (RFC 2920) as well as the BDAT chunks
+ */
+typedef enum {
+	TRANSFER_DATA,
+	TRANSFER_DATA_PIPELINING,
+	TRANSFER_BDAT,
+	TRANSFER_BDAT_PIPELINING,
+	TRANSFER_MAX
+} SMTPTransfer;
+
+extern const char* SMTPTransferName[TRANSFER_MAX];
+
+/*
+ * SMTPCapabilities: what the server announced in its EHLO reply
+ */
+struct SMTPCapabilities
+{
+	bool ehlo = false;		/* EHLO was sent */
+	bool esmtp = false;		/* and accepted */
+	bool size = false;
+	uint64_t size_limit = 0;	/* 0 is no limit */
+	bool pipelining = false;
+	bool chunking = false;
+	bool eightbitmime = false;
+	bool starttls = false;
+
+	void Parse(const std::string& line);
+	std::string Describe() const;
+};
+
+/*
+ * SocketOptions: tuning of each connection's socket, the TCP ones are not
+ *                used for Unix sockets
+ */
+struct SocketOptions
+{
+	bool nodelay = false;		/* TCP_NODELAY */
+	int sndbuf = 0;			/* SO_SNDBUF (bytes), 0 is the default */
+	int rcvbuf = 0;			/* SO_RCVBUF */
+	bool fastopen = false;		/* greet in the SYN (TCP_FASTOPEN_CONNECT) */
+	bool quickack = false;		/* TCP_QUICKACK, after every read */
+	bool linger = false;		/* SO_LINGER 0, close with a reset */
+
+	bool Any() const;
+	std::string Describe() const;
+};
+
+/*
+ * SessionCounters: the system calls a session made and the bytes it moved,
+ *                  to see what each transaction costs the client
+ */
+struct SessionCounters
+{
+	uint64_t syscalls = 0;
+	uint64_t sent = 0;
+	uint64_t received = 0;
+};
+
+class IOUring;
+
+/*
+ * Session: one SMTP (or LMTP) connection, used to run a single ping
+ *          transaction, with blocking sockets or (if given) a worker's
+ *          io_uring
+ */
+class Session
+{
+	public:
+		Session(IOUring* ring = NULL, bool lmtp = false);
+		~Session();
+
+		void SetSocketOptions(const SocketOptions& options)
+			{ m_sockopts = options; }
+
+		bool Connect(const struct addrinfo* res, const struct addrinfo* bind,
+				const char* address);
+		bool Race(const std::vector<const struct addrinfo*>& candidates,
+				const struct addrinfo* bind, double delay,
+				const char* address);
+		bool Greet(const char* helo, bool ehlo = false);
+		bool Transaction(const char* from,
+				const std::vector<std::string>& rcpts,
+				const std::string& data, SMTPTransfer transfer,
+				size_t chunk_size = 0);
+		bool Quit();
+		void Close();
+		void Begin();
+
+		bool IsConnected() const { return m_time[PHASE_CONNECT] >= 0; }
+		bool IsOpen() const { return m_socket != -1; }
+		/* greeted in the SYN, so the handshake is in the banner time */
+		bool IsFastOpen() const { return m_tcp && m_sockopts.fastopen; }
+		/* of the connected address, AF_UNSPEC before connecting */
+		int GetFamily() const { return m_family; }
+		double GetTime(SMTPPhase phase) const;
+		double GetTotalTime() const;
+		SMTPPhase GetFailedPhase() const { return m_failed; }
+		size_t GetReply() const { return m_reply; }
+		const std::string& GetError() const { return m_error; }
+		const SMTPCapabilities& GetCapabilities() const { return m_caps; }
+		SMTPTransfer GetTransfer() const { return m_transfer; }
+		/* acknowledgement latency (ms) of each BDAT chunk */
+		const std::vector<double>& GetChunkTimes() const
+			{ return m_chunk_time; }
+		/* LMTP delivery latency (ms) of each recipient, from the end of
+		   the message */
+		const std::vector<double>& GetRecipientTimes() const
+			{ return m_rcpt_time; }
+		/* since they were last cleared */
+		const SessionCounters& GetCounters() const { return m_counters; }
+		void ClearCounters() { m_counters = SessionCounters(); }
+	private:
+		enum { PIPELINE_WINDOW = 16 };	/* max unacknowledged chunks */
+
+		/* a send queued on the ring, and what to report if it fails */
+		struct PendingSend
+		{
+			SMTPPhase phase;
+			size_t size;
+			const char* error;
+		};
+
+		bool ReadLine(size_t& ret, std::vector<std::string>* lines = NULL);
+		bool Fill();
+		bool Complete(bool read);
+		bool Readable();
+		bool Send(SMTPPhase phase, const std::string& cmd, int flags = 0,
+				const char* error = "send: failed");
+		bool Send(SMTPPhase phase, const char* data, size_t size, int flags,
+				const char* error = "send: failed");
+		bool Command(SMTPPhase phase, const std::string& cmd,
+				const char* name, size_t expect);
+		bool Reply(SMTPPhase phase, const char* name, size_t expect);
+		bool Chunks(const std::string& data, size_t chunk_size,
+				bool pipelining, size_t rcpts);
+		bool Delivered(size_t rcpts, double sent, size_t refused = 0);
+		bool Fail(SMTPPhase phase, const std::string& error);
+		bool Tune(int family);
+		int Attempt(const struct addrinfo* res, const struct addrinfo* bind,
+				const char* address, bool& connected);
+		int SetOption(int level, int name, const void* value,
+				socklen_t size);
+		void QuickAck();
+		void Mark(SMTPPhase phase);
+		void Reset(SMTPPhase from);
+
+		int m_socket;
+		double m_init;
+		double m_start;		/* of the transaction */
+		double m_time[PHASE_MAX];
+		SMTPPhase m_failed;
+		size_t m_reply;
+		std::string m_error;
+		SMTPCapabilities m_caps;
+		SMTPTransfer m_transfer;
+
+		IOUring* m_ring;
+		std::deque<std::string> m_out;		/* queued commands */
+		std::vector<PendingSend> m_sends;
+		char m_buffer[4096];
+		char* m_rbuf;			/* m_buffer or the ring's */
+		size_t m_rsize;
+		size_t m_rpos;
+		size_t m_rlen;
+		std::vector<double> m_chunk_time;
+
+		bool m_lmtp;
+		std::vector<double> m_rcpt_time;
+
+		SocketOptions m_sockopts;
+		bool m_tcp;
+		int m_family;
+
+		SessionCounters m_counters;
+};
+
+#endif
@@ -24,11 +24,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <getopt.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <math.h>
 #include <sys/types.h>
 #include <string>
 #include <vector>
 #include <stdexcept>
 #include <fstream>
+#include <map>
+#include <algorithm>
 
 using std::string;
 using std::vector;
@@ -39,20 +43,48 @@ using std::vector;
 #include <winbase.h>
 #else
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <errno.h>
-#include <semaphore.h>
 #include <sys/mman.h>
-#if _POSIX_SEMAPHORES && MAP_ANONYMOUS
-#define SUPPORT_RATE
+#if MAP_ANONYMOUS
+#define SUPPORT_SHARED
 #endif
 #endif
 
 /* DNS Resolver */
 #include "resolver.hpp"
 
+/* SMTP Session and Statistics */
+#include "session.hpp"
+#include "stats.hpp"
+#include "random.hpp"
+
+/* Worker placement */
+#include "affinity.hpp"
+
+/* io_uring */
+#ifdef HAVE_IO_URING
+#include "uring.hpp"
+#endif
+
+/* Distributed load generation */
+#ifndef __WIN32__
+#include "cluster.hpp"
+#endif
+
+/* Saved results */
+#include "result.hpp"
+
+/* Flight recorder */
+#include "recorder.hpp"
+
+/* Generated envelope addresses */
+#include "generator.hpp"
+
 /*
  * Global Variables
  */
@@ -71,92 +103,18 @@ void sigint_handler(int)
 	signal(SIGINT, SIG_DFL);
 }
 
-/*
- * SMTPReadLine: read a smtp line and return status code
- *               return false on disconnect
- */
-bool SMTPReadLine(int s, size_t& ret)
-{
-#ifdef __WIN32__
-#define MSG_NOSIGNAL 0
-#endif
-	char buf[1];
-	string cmd;
-	int r;
-	do {
-		r = recv(s, buf, sizeof buf, MSG_NOSIGNAL);
-		if (r > 0)
-		{
-			cmd += buf[0];
-			if (buf[0] == '\n')
-			{
-				if (debug)
-					fprintf(stderr, "response %s", cmd.c_str());
-				/* support multi-line responses */
-				if (cmd.size() > 4 && cmd[3] == ' ')
-				{
-					ret = strtoul(cmd.substr(0, 3).c_str(), NULL, 10);
-					return true;
-				} else
-					cmd.clear();
-			}
-		}
-	} while(r > 0);
-	return false;
-}
-
-/*
- * high resolution timers (should return ms with 2 decimals)
- */
-#ifdef WIN32
-#include <windows.h>
-
-double PCFreq = 0.0;
-__int64 CounterStart = 0;
-
-/* initialize counters */
-void StartCounter()
-{
-	LARGE_INTEGER li;
-	if(!QueryPerformanceFrequency(&li))
-		return;
-
-	PCFreq = double(li.QuadPart)/1000.0;
-
-	QueryPerformanceCounter(&li);
-	CounterStart = li.QuadPart;
-}
-
-/* GetHighResTime(): should be ported */
-double GetHighResTime()
-{
-	LARGE_INTEGER li;
-	QueryPerformanceCounter(&li);
-	return double(li.QuadPart-CounterStart)/PCFreq;
-}
-
-#else
-#include <sys/time.h>
-
-/* GetHighResTime(): should be ported */
-double GetHighResTime()
-{
-	struct timeval tv;
-	if(gettimeofday(&tv, NULL) != 0)
-		return 0;
-	return (tv.tv_sec * 1000.0) + (tv.tv_usec / 1000.0);
-}
-#endif
-
 /*
  * usage information, displays all arugments and a short help
  */
 void usage(const char* name, FILE* fp, int status)
 {
 	fprintf(fp,
-		"Usage: " APP_NAME " [ARGS] x@y.z [@server]\n"
+		"Usage: " APP_NAME " [ARGS] x@y.z [@server ...]\n"
+		"       " APP_NAME " --compare [--threshold pct] baseline current\n"
+		"       " APP_NAME " --decode [--csv] [--window from:to] file\n"
 		"Where: x@y.z  is the address that will receive e-mail\n"
-		"       server is the address to connect to (optional)\n"
+		"       server is the address to connect to (optional), several"
+						" are compared\n"
 		"       ARGS   is one or many of: (optional)\n"
 		"       -h, --help\tShow this help message\n"
 		"       -v, --version\tShow version\n"
@@ -164,6 +122,11 @@ void usage(const char* name, FILE* fp, int status)
 		"       -4\t\tUse IPv4\n"
 		"       -6\t\tUse IPv6\n"
 		"       -b, --bind\tBind source address\n"
+		"       --happy-eyeballs\n"
+		"       \t\tRace the IPv6 and IPv4 addresses of the server"
+						" (RFC 8305)\n"
+		"       --attempt-delay\tDelay between raced connection attempts,"
+						" implies --happy-eyeballs [default: 250] (ms)\n"
 		"       -p, --port\tWhich TCP port to use [default: 25]\n"
 		"       -w, --wait\tTime to wait between PINGs [default: 1000]"
 						" (ms)\n"
@@ -172,16 +135,97 @@ void usage(const char* name, FILE* fp, int status)
 		"       -s, --size\tMessage size in kilobytes [default: 10]"
 						" (KiB)\n"
 		"       -f, --file\tSend message file (RFC 822)\n"
+		"       --size-mix\tWeighted message sizes, eg."
+						" 70:4,25:100,5:10240 (%% : KiB)\n"
 		"       -H, --helo\tHELO domain [default: localhost.localdomain]\n"
 		"       -S, --sender\tSender address [default: empty]\n"
+		"       --from-pattern pattern,count[,uniform|zipf[:s]]\n"
+		"       \t\tGenerate senders, %%n replaced by 1..count"
+						" [default: uniform]\n"
+		"       --rcpt-pattern pattern,count[,uniform|zipf[:s]]\n"
+		"       \t\tGenerate recipients the same way\n"
+		"       --seed\t\tSeed of all random choices, to repeat a run"
+						" [default: from the time]\n"
+		"       --lmtp\t\tSpeak LMTP (LHLO, a reply per recipient)"
+						" [default port: 24]\n"
 		"       -C, --chunking\tUse CHUNKING (BDAT)\n"
+		"       --chunk-size\tBDAT chunk size, implies -C [default: whole"
+						" message] (KiB)\n"
+		"       --auto\t\tUse the fastest transfer the server supports"
+						" (EHLO)\n"
+		"       --io-uring\tUse io_uring for socket I/O (Linux)\n"
+		"       --tcp-nodelay\tDisable Nagle's algorithm (TCP_NODELAY)\n"
+		"       --sndbuf\tSocket send buffer (SO_SNDBUF) (bytes)\n"
+		"       --rcvbuf\tSocket receive buffer (SO_RCVBUF) (bytes)\n"
+		"       --tcp-fastopen\tGreet in the SYN, before the banner"
+						" (TCP_FASTOPEN_CONNECT)\n"
+		"       --tcp-quickack\tAck replies at once (TCP_QUICKACK)\n"
+		"       --linger0\tClose with a reset, without TIME_WAIT"
+						" (SO_LINGER 0)\n"
+		"       --cpus\t\tPin workers to these cpus, eg. 0-3,8\n"
+		"       --numa\t\tPlace workers on the NUMA node of this"
+						" interface\n"
 		"       -r, --rate\tShow message rate per second\n"
 		"       -q, --quiet\tShow less output\n"
 		"       -J\t\tRun in jailed mode (forbid --file)\n"
+		"       --saturate min:step:max\n"
+		"       \t\tSearch for the knee by stepping concurrency\n"
+		"       --saturate-rate min:step:max\n"
+		"       \t\tSearch for the knee by stepping offered rate"
+						" (msgs/s, with -P)\n"
+		"       --hold\t\tTime to hold each saturation step"
+						" [default: 10] (s)\n"
+		"       --slo\t\tp99 latency objective for saturation and"
+						" --adaptive [default: none] (ms)\n"
+		"       --adaptive\tAdapt active workers (AIMD) up to"
+						" this maximum\n"
+		"       --interval\tAdaptive control interval [default: 1]"
+						" (s)\n"
+		"       --duration\tStop after this long [default: unlimited]"
+						" (s)\n"
+		"       --pool\t\tKeep each worker's connection open, set up"
+						" before sending\n"
+		"       --pool-ramp\tConnections opened per second by --pool"
+						" [default: unlimited]\n"
+		"       --backoff min:max\n"
+		"       \t\tBack off exponentially (with jitter) after"
+						" temporary failures (ms)\n"
+		"       --report\tShow throughput, latency and errors every"
+						" interval (s, with -P)\n"
+		"       --dns\t\tTime resolving the MX, then A/AAAA of the"
+						" exchangers\n"
+		"       \t\t(@server is the name server to query, IPv4)\n"
+		"       --coordinator port\n"
+		"       \t\tRun this test on agents, merging their"
+						" statistics\n"
+		"       --agents\tNumber of agents to wait for [default: 1]\n"
+		"       --agent host:port\n"
+		"       \t\tGenerate load for a coordinator\n"
+		"       --replay\tSend messages at the times of a trace file\n"
+		"       --speed\tReplay speed-up factor [default: 1]\n"
+		"       --scenario\tRun the phases of a scenario file\n"
+		"       --mirror\tSend each @server the load of -P, instead of"
+						" splitting it\n"
+		"       --save\t\tSave the statistics of the run to a result"
+						" file\n"
+		"       --compare\tCompare two result files, exit 1 on a"
+						" regression\n"
+		"       --threshold\tRegression threshold for --compare"
+						" [default: 5] (%%)\n"
+		"       --record\tRecord every transaction to a file (binary,"
+						" see --decode)\n"
+		"       --record-events\tEvents kept per worker by --record"
+						" [default: 65536]\n"
+		"       --decode\tSummarize the events of a --record file\n"
+		"       --csv\t\tDecode the events as CSV instead\n"
+		"       --window from:to\n"
+		"       \t\tDecode only the events in this window, 0 is the"
+						" end (s)\n"
 		"\n"
 		"  If no @server is specified, " APP_NAME " will try to find "
 		"the recipient domain's\n  MX record, falling back on A/AAAA "
-		"records.\n"
+		"records. Use @unix:/path for a Unix socket, and\n  @host:port or "
+		"@[host]:port for another port than -p.\n"
 		"\n"
 		"  " APP_NAME " " APP_VERSION " built on " __DATE__
 		" (c) Halon Security <support@halon.se>\n"
@@ -189,38 +233,214 @@ void usage(const char* name, FILE* fp, int status)
 	exit(status);
 }
 
-int main(int argc, char* argv[])
+/*
+ * SizeClass: one weighted message size of --size-mix
+ */
+struct SizeClass
 {
-	/* register signal handlers */
-	signal(SIGINT, sigint_handler);
-
-#ifdef __WIN32__
-	/* initialize winsock */
-	WSAData wData;
-	WSAStartup(MAKEWORD(2,2), &wData);
-#endif
+	unsigned int weight;
+	unsigned int size;	/* KiB */
+};
 
-	/* default pareamters */
+/*
+ * Options: command line parameters, shared by all workers
+ */
+struct Options
+{
 	const char *smtp_bind = NULL;
 	const char *smtp_helo = "localhost.localdomain";
 	const char *smtp_from = "";
-	const char *smtp_port = "25";
+	const char *smtp_port = NULL;	/* 25, 24 for LMTP or 53 for DNS */
 	const char *smtp_rcpt = NULL;
 	const char *smtp_file = NULL;
 	unsigned int smtp_probes = 0;
 	unsigned int smtp_probe_wait = 1000;
 	unsigned int smtp_data_size = 10;
+	vector<SizeClass> size_mix;
 	unsigned int forks = 0;
 	bool show_rate = false;
 	bool quiet = false;
 	bool safe_mode = false;
 	unsigned int proto = 0;
+	bool lmtp = false;
 	bool chunking = false;
+	unsigned int chunk_size = 0;	/* KiB, 0 is the whole message */
+	bool auto_transfer = false;
+	bool io_uring = false;
+
+	/* socket tuning */
+	SocketOptions sockopts;
+
+	/* worker placement */
+	vector<int> cpus;
+	const char *numa = NULL;
+
+	/* saturation search */
+	bool saturate = false;
+	bool saturate_rate = false;
+	unsigned int saturate_min = 0;
+	unsigned int saturate_step = 0;
+	unsigned int saturate_max = 0;
+	unsigned int saturate_hold = 10;
+
+	/* adaptive concurrency */
+	unsigned int adaptive = 0;
+	double interval = 1;
+
+	double slo = 0;
+	double duration = 0;
+
+	/* pre-warmed connections */
+	bool pool = false;
+	double pool_ramp = 0;
+
+	/* retrying temporary failures */
+	unsigned int backoff_min = 0;
+	unsigned int backoff_max = 0;
+
+	/* interval reporting */
+	double report = 0;
+
+	/* DNS probing, against server or the system's resolver */
+	bool dns = false;
+	const char *dns_server = NULL;
+
+	/* distributed load generation */
+	const char *coordinator = NULL;
+	unsigned int agents = 1;
+	const char *agent = NULL;
+
+	/* trace replay */
+	const char *replay = NULL;
+	double speed = 1;
+
+	/* multi-phase scenario */
+	const char *scenario = NULL;
+
+	/* several @servers: -P split between them, or each given -P */
+	bool mirror = false;
+
+	/* generated envelope addresses, instead of -S and x@y.z */
+	AddressGenerator from_pattern;
+	AddressGenerator rcpt_pattern;
+
+	/* racing the addresses of a server (RFC 8305) */
+	bool happy_eyeballs = false;
+	double attempt_delay = 250;	/* ms */
+
+	/* random choices, each worker draws its own stream of seed */
+	bool seeded = false;	/* given by --seed */
+	uint64_t seed = 0;
+
+	/* saved results */
+	const char *save = NULL;
+	bool compare = false;
+	double threshold = 5;
+
+	/* flight recorder */
+	const char *record = NULL;
+	unsigned int record_events = 65536;	/* per worker */
+	bool decode = false;
+	bool csv = false;
+	double window_from = 0;	/* s */
+	double window_to = 0;	/* s, 0 is the end */
+};
+
+enum {
+	OPT_SATURATE = 256,
+	OPT_SATURATE_RATE,
+	OPT_HOLD,
+	OPT_SLO,
+	OPT_ADAPTIVE,
+	OPT_INTERVAL,
+	OPT_DURATION,
+	OPT_COORDINATOR,
+	OPT_AGENTS,
+	OPT_AGENT,
+	OPT_REPLAY,
+	OPT_SPEED,
+	OPT_SIZE_MIX,
+	OPT_SCENARIO,
+	OPT_CHUNK_SIZE,
+	OPT_AUTO,
+	OPT_IO_URING,
+	OPT_CPUS,
+	OPT_NUMA,
+	OPT_REPORT,
+	OPT_BACKOFF,
+	OPT_LMTP,
+	OPT_POOL,
+	OPT_POOL_RAMP,
+	OPT_TCP_NODELAY,
+	OPT_SNDBUF,
+	OPT_RCVBUF,
+	OPT_TCP_FASTOPEN,
+	OPT_TCP_QUICKACK,
+	OPT_LINGER0,
+	OPT_SAVE,
+	OPT_COMPARE,
+	OPT_THRESHOLD,
+	OPT_DNS,
+	OPT_RECORD,
+	OPT_RECORD_EVENTS,
+	OPT_DECODE,
+	OPT_CSV,
+	OPT_WINDOW,
+	OPT_MIRROR,
+	OPT_FROM_PATTERN,
+	OPT_RCPT_PATTERN,
+	OPT_SEED,
+	OPT_HAPPY_EYEBALLS,
+	OPT_ATTEMPT_DELAY,
+};
 
-	/* no arguments: show help */
-	if (argc < 2)
-		usage(argv[0], stderr, 2);
+/*
+ * ParseRange: parse "min:step:max"
+ */
+static bool ParseRange(const char* arg, unsigned int& min, unsigned int& step,
+		unsigned int& max)
+{
+	char* end;
+	min = strtoul(arg, &end, 10);
+	if (*end != ':')
+		return false;
+	step = strtoul(end + 1, &end, 10);
+	if (*end != ':')
+		return false;
+	max = strtoul(end + 1, &end, 10);
+	return *end == '\0' && step > 0 && min > 0 && min <= max;
+}
+
+/*
+ * ParseSizeMix: parse "weight:size,weight:size,..."
+ */
+static bool ParseSizeMix(const char* arg, vector<SizeClass>& mix)
+{
+	mix.clear();
+	const char* p = arg;
+	for (;;)
+	{
+		SizeClass c;
+		char* end;
+		c.weight = strtoul(p, &end, 10);
+		if (*end != ':' || c.weight == 0)
+			return false;
+		c.size = strtoul(end + 1, &end, 10);
+		mix.push_back(c);
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			return false;
+		p = end + 1;
+	}
+	return true;
+}
 
+/*
+ * ParseOptions: parse command line, argc/argv are moved past the options
+ */
+static void ParseOptions(int& argc, char**& argv, Options& opts)
+{
 	/* getopts/longopts */
 	static struct option longopts[] = {
 		{ "help",	no_argument,		NULL,	'h'	},
@@ -237,6 +457,51 @@ int main(int argc, char* argv[])
 		{ "quiet",	no_argument,	NULL,	'q'	},
 		{ "bind",	required_argument,	NULL,	'b'	},
 		{ "chunking",	no_argument,	NULL,	'C'	},
+		{ "saturate",	required_argument,	NULL,	OPT_SATURATE	},
+		{ "saturate-rate",	required_argument,	NULL,	OPT_SATURATE_RATE	},
+		{ "hold",	required_argument,	NULL,	OPT_HOLD	},
+		{ "slo",	required_argument,	NULL,	OPT_SLO	},
+		{ "adaptive",	required_argument,	NULL,	OPT_ADAPTIVE	},
+		{ "interval",	required_argument,	NULL,	OPT_INTERVAL	},
+		{ "duration",	required_argument,	NULL,	OPT_DURATION	},
+		{ "coordinator",	required_argument,	NULL,	OPT_COORDINATOR	},
+		{ "agents",	required_argument,	NULL,	OPT_AGENTS	},
+		{ "agent",	required_argument,	NULL,	OPT_AGENT	},
+		{ "replay",	required_argument,	NULL,	OPT_REPLAY	},
+		{ "speed",	required_argument,	NULL,	OPT_SPEED	},
+		{ "size-mix",	required_argument,	NULL,	OPT_SIZE_MIX	},
+		{ "scenario",	required_argument,	NULL,	OPT_SCENARIO	},
+		{ "chunk-size",	required_argument,	NULL,	OPT_CHUNK_SIZE	},
+		{ "auto",	no_argument,	NULL,	OPT_AUTO	},
+		{ "io-uring",	no_argument,	NULL,	OPT_IO_URING	},
+		{ "tcp-nodelay",	no_argument,	NULL,	OPT_TCP_NODELAY	},
+		{ "sndbuf",	required_argument,	NULL,	OPT_SNDBUF	},
+		{ "rcvbuf",	required_argument,	NULL,	OPT_RCVBUF	},
+		{ "tcp-fastopen",	no_argument,	NULL,	OPT_TCP_FASTOPEN	},
+		{ "tcp-quickack",	no_argument,	NULL,	OPT_TCP_QUICKACK	},
+		{ "linger0",	no_argument,	NULL,	OPT_LINGER0	},
+		{ "save",	required_argument,	NULL,	OPT_SAVE	},
+		{ "compare",	no_argument,	NULL,	OPT_COMPARE	},
+		{ "threshold",	required_argument,	NULL,	OPT_THRESHOLD	},
+		{ "cpus",	required_argument,	NULL,	OPT_CPUS	},
+		{ "numa",	required_argument,	NULL,	OPT_NUMA	},
+		{ "report",	required_argument,	NULL,	OPT_REPORT	},
+		{ "backoff",	required_argument,	NULL,	OPT_BACKOFF	},
+		{ "lmtp",	no_argument,	NULL,	OPT_LMTP	},
+		{ "pool",	no_argument,	NULL,	OPT_POOL	},
+		{ "pool-ramp",	required_argument,	NULL,	OPT_POOL_RAMP	},
+		{ "dns",	no_argument,	NULL,	OPT_DNS	},
+		{ "record",	required_argument,	NULL,	OPT_RECORD	},
+		{ "record-events",	required_argument,	NULL,	OPT_RECORD_EVENTS	},
+		{ "decode",	no_argument,	NULL,	OPT_DECODE	},
+		{ "csv",	no_argument,	NULL,	OPT_CSV	},
+		{ "window",	required_argument,	NULL,	OPT_WINDOW	},
+		{ "mirror",	no_argument,	NULL,	OPT_MIRROR	},
+		{ "from-pattern",	required_argument,	NULL,	OPT_FROM_PATTERN	},
+		{ "rcpt-pattern",	required_argument,	NULL,	OPT_RCPT_PATTERN	},
+		{ "seed",	required_argument,	NULL,	OPT_SEED	},
+		{ "happy-eyeballs",	no_argument,	NULL,	OPT_HAPPY_EYEBALLS	},
+		{ "attempt-delay",	required_argument,	NULL,	OPT_ATTEMPT_DELAY	},
 		{ NULL,		0,			NULL,	0	}
 	};
 	opterr = 0;
@@ -247,165 +512,706 @@ int main(int argc, char* argv[])
 		switch(ch)
 		{
 			case 'H':
-				smtp_helo = optarg;
+				opts.smtp_helo = optarg;
 				break;
 			case 'S':
-				smtp_from = optarg;
+				opts.smtp_from = optarg;
 				break;
 			case 's':
-				smtp_data_size = strtoul(optarg, NULL, 10);
+				opts.smtp_data_size = strtoul(optarg, NULL, 10);
 				break;
 			case 'h':
 				usage(argv[0], stdout, 0);
 				break;
 			case 'w':
-				smtp_probe_wait = strtoul(optarg, NULL, 10);
+				opts.smtp_probe_wait = strtoul(optarg, NULL, 10);
 				break;
 			case 'c':
-				smtp_probes = strtoul(optarg, NULL, 10);
+				opts.smtp_probes = strtoul(optarg, NULL, 10);
 				break;
 			case 'p':
-				smtp_port = optarg;
+				opts.smtp_port = optarg;
 				break;
 			case 'P':
-				forks = strtoul(optarg, NULL, 10);
+				opts.forks = strtoul(optarg, NULL, 10);
 				break;
 			case 'd':
 				debug = true;
 				break;
 			case 'r':
-				show_rate = true;
-				quiet = true;
+				opts.show_rate = true;
+				opts.quiet = true;
 				break;
 			case 'q':
-				quiet = true;
+				opts.quiet = true;
 				break;
 			case 'f':
-				smtp_file = optarg;
+				opts.smtp_file = optarg;
 				break;
 			case 'J':
-				safe_mode = true;
+				opts.safe_mode = true;
 				break;
 			case '4':
-				proto = AF_INET;
+				opts.proto = AF_INET;
 				break;
 			case '6':
-				proto = AF_INET6;
+				opts.proto = AF_INET6;
 				break;
 			case 'b':
-				smtp_bind = optarg;
+				opts.smtp_bind = optarg;
 				break;
 			case 'C':
-				chunking = true;
+				opts.chunking = true;
 				break;
 			case 'v':
 				printf("%s\n", APP_VERSION);
 				exit(0);
 				break;
+			case OPT_SATURATE:
+			case OPT_SATURATE_RATE:
+				if (!ParseRange(optarg, opts.saturate_min,
+							opts.saturate_step, opts.saturate_max))
+					usage(argv[0], stderr, 2);
+				opts.saturate = true;
+				opts.saturate_rate = ch == OPT_SATURATE_RATE;
+				opts.quiet = true;
+				break;
+			case OPT_HOLD:
+				opts.saturate_hold = strtoul(optarg, NULL, 10);
+				break;
+			case OPT_SLO:
+				opts.slo = strtod(optarg, NULL);
+				break;
+			case OPT_ADAPTIVE:
+				opts.adaptive = strtoul(optarg, NULL, 10);
+				if (opts.adaptive == 0)
+					usage(argv[0], stderr, 2);
+				opts.quiet = true;
+				break;
+			case OPT_INTERVAL:
+				opts.interval = strtod(optarg, NULL);
+				if (opts.interval <= 0)
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_DURATION:
+				opts.duration = strtod(optarg, NULL);
+				break;
+			case OPT_COORDINATOR:
+				opts.coordinator = optarg;
+				break;
+			case OPT_AGENTS:
+				opts.agents = strtoul(optarg, NULL, 10);
+				if (opts.agents == 0)
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_AGENT:
+				opts.agent = optarg;
+				break;
+			case OPT_REPLAY:
+				opts.replay = optarg;
+				break;
+			case OPT_SIZE_MIX:
+				if (!ParseSizeMix(optarg, opts.size_mix))
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_SPEED:
+				opts.speed = strtod(optarg, NULL);
+				if (opts.speed <= 0)
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_SCENARIO:
+				opts.scenario = optarg;
+				opts.quiet = true;
+				break;
+			case OPT_CHUNK_SIZE:
+				opts.chunk_size = strtoul(optarg, NULL, 10);
+				if (opts.chunk_size == 0)
+					usage(argv[0], stderr, 2);
+				opts.chunking = true;
+				break;
+			case OPT_AUTO:
+				opts.auto_transfer = true;
+				break;
+			case OPT_IO_URING:
+				opts.io_uring = true;
+				break;
+			case OPT_TCP_NODELAY:
+				opts.sockopts.nodelay = true;
+				break;
+			case OPT_SNDBUF:
+			case OPT_RCVBUF:
+				{
+					int size = atoi(optarg);
+					if (size <= 0)
+						usage(argv[0], stderr, 2);
+					if (ch == OPT_SNDBUF)
+						opts.sockopts.sndbuf = size;
+					else
+						opts.sockopts.rcvbuf = size;
+				}
+				break;
+			case OPT_TCP_FASTOPEN:
+				opts.sockopts.fastopen = true;
+				break;
+			case OPT_TCP_QUICKACK:
+				opts.sockopts.quickack = true;
+				break;
+			case OPT_LINGER0:
+				opts.sockopts.linger = true;
+				break;
+			case OPT_SAVE:
+				opts.save = optarg;
+				break;
+			case OPT_COMPARE:
+				opts.compare = true;
+				break;
+			case OPT_THRESHOLD:
+				opts.threshold = strtod(optarg, NULL);
+				if (opts.threshold <= 0)
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_CPUS:
+				if (!ParseCPUList(optarg, opts.cpus))
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_NUMA:
+				opts.numa = optarg;
+				break;
+			case OPT_BACKOFF:
+				{
+					char* end;
+					opts.backoff_min = strtoul(optarg, &end, 10);
+					if (*end != ':')
+						usage(argv[0], stderr, 2);
+					opts.backoff_max = strtoul(end + 1, &end, 10);
+					if (*end != '\0' || opts.backoff_min == 0 ||
+							opts.backoff_max < opts.backoff_min)
+						usage(argv[0], stderr, 2);
+				}
+				break;
+			case OPT_LMTP:
+				opts.lmtp = true;
+				break;
+			case OPT_POOL:
+				opts.pool = true;
+				break;
+			case OPT_POOL_RAMP:
+				opts.pool_ramp = strtod(optarg, NULL);
+				if (opts.pool_ramp <= 0)
+					usage(argv[0], stderr, 2);
+				opts.pool = true;
+				break;
+			case OPT_REPORT:
+				opts.report = strtod(optarg, NULL);
+				if (opts.report <= 0)
+					usage(argv[0], stderr, 2);
+				opts.quiet = true;
+				break;
+			case OPT_DNS:
+				opts.dns = true;
+				break;
+			case OPT_RECORD:
+				opts.record = optarg;
+				break;
+			case OPT_RECORD_EVENTS:
+				opts.record_events = strtoul(optarg, NULL, 10);
+				if (opts.record_events == 0)
+					usage(argv[0], stderr, 2);
+				break;
+			case OPT_DECODE:
+				opts.decode = true;
+				break;
+			case OPT_CSV:
+				opts.csv = true;
+				break;
+			case OPT_WINDOW:
+				{
+					char* end;
+					opts.window_from = strtod(optarg, &end);
+					if (*end != ':')
+						usage(argv[0], stderr, 2);
+					opts.window_to = strtod(end + 1, &end);
+					if (*end != '\0' || opts.window_from < 0 ||
+							(opts.window_to != 0 &&
+							 opts.window_to <= opts.window_from))
+						usage(argv[0], stderr, 2);
+				}
+				break;
+			case OPT_MIRROR:
+				opts.mirror = true;
+				break;
+			case OPT_FROM_PATTERN:
+			case OPT_RCPT_PATTERN:
+				{
+					string error;
+					if (!(ch == OPT_FROM_PATTERN ? opts.from_pattern :
+								opts.rcpt_pattern).Parse(optarg, error))
+					{
+						fprintf(stderr, "--%s-pattern: %s\n",
+								ch == OPT_FROM_PATTERN ? "from" : "rcpt",
+								error.c_str());
+						exit(2);
+					}
+				}
+				break;
+			case OPT_HAPPY_EYEBALLS:
+				opts.happy_eyeballs = true;
+				break;
+			case OPT_ATTEMPT_DELAY:
+				{
+					char* end;
+					opts.attempt_delay = strtod(optarg, &end);
+					if (end == optarg || *end != '\0' ||
+							opts.attempt_delay < 0)
+						usage(argv[0], stderr, 2);
+					opts.happy_eyeballs = true;
+				}
+				break;
+			case OPT_SEED:
+				{
+					char* end;
+					opts.seed = strtoull(optarg, &end, 10);
+					if (end == optarg || *end != '\0')
+						usage(argv[0], stderr, 2);
+					opts.seeded = true;
+				}
+				break;
 			default:
 				usage(argv[0], stderr, 2);
 				break;
 		}
 	}
-	if (safe_mode && smtp_file)
+	if (opts.safe_mode && opts.smtp_file)
+	{
+		fprintf(stderr, "-f is not allowed in jailed mode (-J)\n");
+		usage(argv[0], stderr, 2);
+	}
+	if (opts.smtp_file && !opts.size_mix.empty())
 		usage(argv[0], stderr, 2);
+	if (!opts.smtp_port)
+		opts.smtp_port = opts.lmtp ? "24" : opts.dns ? "53" : "25";
 
 	argc -= optind;
 	argv += optind;
+}
 
-	/* no e-mail or mx specified */
-	if (argc < 1)
-		usage(argv[0], stderr, 2);
-
-	/* mail address */
-	smtp_rcpt = argv[0];
-
+/*
+ * BuildMessage: read file or generate a message of approximately size bytes
+ */
+static string BuildMessage(const Options& opts, const char* file, size_t size)
+{
 	string data;
-	if (smtp_file) {
+	if (file) {
 	/* read smtp_file */
-	std::ifstream ifs(smtp_file, std::ios::in | std::ios::binary);
+	std::ifstream ifs(file, std::ios::in | std::ios::binary);
 	if (!ifs.good())
 		fprintf(stderr, "warning: file %s could not be opened\n"
-				, smtp_file);
+				, file);
 	else
 		data.append(std::istreambuf_iterator<char>(ifs.rdbuf()),
 				std::istreambuf_iterator<char>());
-	if (!chunking) data += ".\r\n";
 	} else {
 	/* generate message with approximatly size */
 	data += "Subject: SMTP Ping\r\n";
 	data += "Content-Type: text/plain\r\n";
-	data += string("From: <") + smtp_from + ">\r\n";
-	data += string("To: <") + smtp_rcpt + ">\r\n";
+	data += string("From: <") + opts.smtp_from + ">\r\n";
+	data += string("To: <") + opts.smtp_rcpt + ">\r\n";
 	data += "\r\n";
-	while (data.size() / 1024 < smtp_data_size)
+	while (data.size() < size)
 		data += "AABBCCDDEEFFGGHHIIJJKKLLMMNNOOPPQQRRSSTTUUVVWWXXYYZZ"
 				"00112233445566778899\r\n";
-	if (!chunking) data += "\r\n.\r\n";
+	data += "\r\n";
 	}
-	if (chunking) data = "BDAT " + std::to_string(data.size()) + " LAST\r\n" + data;
+	/* the session adds the end of data, or sends it in BDAT chunks */
+	return data;
+}
 
-	Resolver resolv;
-	vector<string> address;
+/*
+ * TraceEntry: one recorded arrival of a --replay trace
+ */
+struct TraceEntry
+{
+	double offset;		/* ms since the start of the trace */
+	size_t body;		/* index in Workload::bodies */
+	unsigned int rcpts;
+	string sender;
+};
 
-	/* user@example.com @mailserver */
-	if (argc > 1)
+/*
+ * SizeMix: weighted choice between the size classes of a Workload
+ */
+struct SizeMix
+{
+	vector<unsigned int> weight;
+	vector<size_t> size_class;
+	unsigned int total = 0;		/* sum of the weights */
+};
+
+/*
+ * ScenarioPhase: one phase of a --scenario, concurrency and rate ramp
+ *                linearly from the first to the second value
+ */
+struct ScenarioPhase
+{
+	string name;
+	double duration = 0;		/* s */
+	double concurrency[2] = { 1, 1 };
+	double rate[2] = { 0, 0 };	/* msgs/s, 0 means unpaced */
+	SizeMix size_mix;		/* empty means the --size-mix */
+};
+
+/*
+ * Workload: the messages to send, prepared before forking so that the
+ *           message bodies are shared by all workers
+ */
+struct Workload
+{
+	string data;
+	vector<string> bodies;
+	vector<TraceEntry> trace;
+	vector<unsigned int> sizes;	/* size classes (KiB) */
+	vector<string> size_bodies;	/* one body per size class */
+	SizeMix size_mix;
+	vector<ScenarioPhase> scenario;
+};
+
+/*
+ * BuildSizeMix: add the sizes of a mix to the size classes of the workload
+ *               (building their bodies), at most Statistics::SIZE_CLASSES
+ */
+static bool BuildSizeMix(const Options& opts, const vector<SizeClass>& classes,
+		Workload& workload, SizeMix& mix)
+{
+	for (vector<SizeClass>::const_iterator c = classes.begin();
+			c != classes.end(); ++c)
 	{
-		if (argv[1][0] != '@')
-			usage(argv[0], stderr, 2);
+		size_t i = 0;
+		while (i < workload.sizes.size() && workload.sizes[i] != c->size)
+			i++;
+		if (i == workload.sizes.size())
+		{
+			if (i >= Statistics::SIZE_CLASSES)
+			{
+				fprintf(stderr, "at most %d message sizes can be mixed\n",
+						Statistics::SIZE_CLASSES);
+				return false;
+			}
+			workload.sizes.push_back(c->size);
+			workload.size_bodies.push_back(BuildMessage(opts, NULL,
+						c->size * 1024));
+		}
+		mix.weight.push_back(c->weight);
+		mix.size_class.push_back(i);
+		mix.total += c->weight;
+	}
+	return true;
+}
 
-		/* jmp past '@' */
-		const char* domain = argv[1] + 1;
+/*
+ * LoadTrace: read a --replay trace, one arrival per line
+ *
+ *   # offset (ms)  size (bytes) or @file  recipients  [sender]
+ *   0              4096                   1
+ *   12.5           @newsletter.eml        3           news@example.com
+ */
+static bool LoadTrace(const Options& opts, Workload& workload)
+{
+	std::ifstream ifs(opts.replay);
+	if (!ifs.good())
+	{
+		fprintf(stderr, "replay: file %s could not be opened\n", opts.replay);
+		return false;
+	}
 
-		char buf[sizeof(struct in6_addr)];
-		if (inet_pton(AF_INET, domain, &buf) == 1 || inet_pton(AF_INET6, domain, &buf) == 1)
-			address.push_back(domain);
+	std::map<string, size_t> bodies;
+	string line;
+	for (unsigned int n = 1; std::getline(ifs, line); ++n)
+	{
+		if (line.empty() || line[0] == '#' || line.find_first_not_of(" \t\r") == string::npos)
+			continue;
+
+		char body[1024], sender[1024] = "";
+		TraceEntry entry;
+		if (sscanf(line.c_str(), "%lf %1023s %u %1023s", &entry.offset, body,
+					&entry.rcpts, sender) < 3 || entry.offset < 0 ||
+				entry.rcpts == 0)
+		{
+			fprintf(stderr, "replay: %s:%u: syntax error\n", opts.replay, n);
+			return false;
+		}
+		entry.sender = sender[0] && strcmp(sender, "-") != 0 ? sender :
+			opts.smtp_from;
+
+		/* bodies are built once per size or file */
+		std::map<string, size_t>::const_iterator i = bodies.find(body);
+		if (i != bodies.end())
+			entry.body = i->second;
 		else
 		{
-			/* resolve as A/AAAA */
-			if (!resolv.Lookup(domain, Resolver::RR_A, address))
-				if (debug) fprintf(stderr, "warning: failed to resolve "
-						"A for %s\n", domain);
-			if (!resolv.Lookup(domain, Resolver::RR_AAAA, address))
-				if (debug) fprintf(stderr, "warning: failed to resolve "
-						"AAAA for %s\n", domain);
-			/* could not resolve, try to use address */
-			if (address.empty())
-				address.push_back(domain);
+			entry.body = workload.bodies.size();
+			workload.bodies.push_back(body[0] == '@' ?
+					BuildMessage(opts, body + 1, 0) :
+					BuildMessage(opts, NULL, strtoul(body, NULL, 10)));
+			bodies[body] = entry.body;
 		}
-	} else
+		workload.trace.push_back(entry);
+	}
+	if (workload.trace.empty())
 	{
-		/* use mailaddress as mx */
-		const char* domain = strrchr(smtp_rcpt, '@');
+		fprintf(stderr, "replay: %s has no entries\n", opts.replay);
+		return false;
+	}
+	return true;
+}
 
-		/* no domain, abort! */
-		if (!domain)
-			usage(argv[0], stderr, 2);
+/*
+ * ParseRamp: parse "value" or "from..to"
+ */
+static bool ParseRamp(const char* arg, double ramp[2])
+{
+	/* split first, strtod() would take "2..6" as "2." */
+	string from = arg, to = arg;
+	size_t dots = from.find("..");
+	if (dots != string::npos)
+	{
+		from.erase(dots);
+		to.erase(0, dots + 2);
+	}
+	char *end_from, *end_to;
+	ramp[0] = strtod(from.c_str(), &end_from);
+	ramp[1] = strtod(to.c_str(), &end_to);
+	return end_from != from.c_str() && *end_from == '\0' &&
+		end_to != to.c_str() && *end_to == '\0' &&
+		ramp[0] >= 0 && ramp[1] >= 0;
+}
 
-		/* jmp past '@' */
-		domain += 1;
+/*
+ * LoadScenario: read a --scenario, one section per phase
+ *
+ *   # name of the phase
+ *   [ramp]
+ *   duration = 60          (s)
+ *   concurrency = 2..20    (workers, from..to ramps linearly)
+ *   rate = 10..100         (msgs/s, 0 is unpaced) [default: 0]
+ *   size-mix = 70:4,30:100 [default: --size-mix or -s]
+ */
+static bool LoadScenario(const Options& opts, Workload& workload)
+{
+	std::ifstream ifs(opts.scenario);
+	if (!ifs.good())
+	{
+		fprintf(stderr, "scenario: file %s could not be opened\n",
+				opts.scenario);
+		return false;
+	}
 
-		/* resolve as MX, with A/AAAA fallback */
-		vector<string> mx;
-		if (!resolv.Lookup(domain, Resolver::RR_MX, mx))
+	string line;
+	for (unsigned int n = 1; std::getline(ifs, line); ++n)
+	{
+		size_t b = line.find_first_not_of(" \t");
+		size_t e = line.find_last_not_of(" \t\r");
+		if (b == string::npos || line[b] == '#')
+			continue;
+		line = line.substr(b, e - b + 1);
+
+		if (line[0] == '[' && line[line.size() - 1] == ']')
 		{
-			/* if dns failed, we should not try A/AAAA,
-			   only if no data is returned */
-			fprintf(stderr, "failed to resolve %s\n", domain);
+			ScenarioPhase phase;
+			phase.name = line.substr(1, line.size() - 2);
+			workload.scenario.push_back(phase);
+			continue;
+		}
+
+		size_t eq = line.find('=');
+		if (workload.scenario.empty() || eq == string::npos)
+		{
+			fprintf(stderr, "scenario: %s:%u: syntax error\n",
+					opts.scenario, n);
+			return false;
+		}
+		ScenarioPhase& phase = workload.scenario.back();
+		string key = line.substr(0, eq), value = line.substr(eq + 1);
+		key.erase(key.find_last_not_of(" \t") + 1);
+		value.erase(0, value.find_first_not_of(" \t"));
+
+		bool ok;
+		if (key == "duration")
+		{
+			char* end;
+			phase.duration = strtod(value.c_str(), &end);
+			ok = *end == '\0' && phase.duration > 0;
+		} else if (key == "concurrency")
+			ok = ParseRamp(value.c_str(), phase.concurrency) &&
+				phase.concurrency[0] >= 1 && phase.concurrency[1] >= 1;
+		else if (key == "rate")
+			ok = ParseRamp(value.c_str(), phase.rate);
+		else if (key == "size-mix")
+		{
+			vector<SizeClass> mix;
+			ok = ParseSizeMix(value.c_str(), mix);
+			if (ok && !BuildSizeMix(opts, mix, workload, phase.size_mix))
+				return false;
 		} else
 		{
-			/* no data, try A/AAAAA */
-			if (mx.empty())
-			{
-				if (debug) fprintf(stderr, " no mx, failling "
-					"back on A/AAAA record for %s\n",
-					domain);
+			fprintf(stderr, "scenario: %s:%u: unknown key %s\n",
+					opts.scenario, n, key.c_str());
+			return false;
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "scenario: %s:%u: bad %s\n",
+					opts.scenario, n, key.c_str());
+			return false;
+		}
+	}
+	if (workload.scenario.empty())
+	{
+		fprintf(stderr, "scenario: %s has no phases\n", opts.scenario);
+		return false;
+	}
+	for (size_t p = 0; p < workload.scenario.size(); ++p)
+	{
+		if (workload.scenario[p].duration <= 0)
+		{
+			fprintf(stderr, "scenario: phase %s has no duration\n",
+					workload.scenario[p].name.c_str());
+			return false;
+		}
+	}
+	return true;
+}
 
-				if (!resolv.Lookup(domain, Resolver::RR_A,
-					address))
-					if (debug) fprintf(stderr, "failed to "
-						"resolve A for %s\n", domain);
-				if (!resolv.Lookup(domain, Resolver::RR_AAAA,
+/*
+ * IsUnixAddress: whether address is a "unix:/path" address
+ */
+static bool IsUnixAddress(const string& address)
+{
+	return address.compare(0, 5, "unix:") == 0;
+}
+
+#ifndef __WIN32__
+/*
+ * UnixAddress: an addrinfo for a "unix:/path" address, pointing to sun
+ */
+static bool UnixAddress(const string& address, struct sockaddr_un& sun,
+		struct addrinfo& res)
+{
+	string path = address.substr(5);
+	if (path.empty() || path.size() >= sizeof sun.sun_path)
+		return false;
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path.c_str(), path.size());
+	memset(&res, 0, sizeof res);
+	res.ai_family = AF_UNIX;
+	res.ai_socktype = SOCK_STREAM;
+	res.ai_addr = (struct sockaddr*)&sun;
+	res.ai_addrlen = sizeof sun;
+	return true;
+}
+#endif
+
+/*
+ * SplitPort: split the port off "host:port" or "[host]:port", leaving
+ *            IPv6 addresses and unix: paths without one whole
+ */
+static void SplitPort(const string& server, string& host, string& port)
+{
+	host = server;
+	if (IsUnixAddress(server))
+		return;
+	if (server[0] == '[')
+	{
+		size_t end = server.find(']');
+		if (end == string::npos)
+			return;
+		host = server.substr(1, end - 1);
+		if (server.compare(end + 1, 1, ":") == 0)
+			port = server.substr(end + 2);
+	} else if (std::count(server.begin(), server.end(), ':') == 1)
+	{
+		size_t colon = server.find(':');
+		host = server.substr(0, colon);
+		port = server.substr(colon + 1);
+	}
+}
+
+/*
+ * Target: an @server (or the recipient domain), its port and the addresses
+ *         it resolved to; with several, workers take turns between them
+ */
+struct Target
+{
+	unsigned int id;
+	string name;
+	string port;
+	vector<string> address;
+};
+
+/*
+ * ResolveAddress: find the addresses to connect to, either from @server
+ *                 or from the recipient domain's MX (or A/AAAA) records
+ */
+static void ResolveAddress(const Options& opts, const char* server,
+		vector<string>& address)
+{
+	Resolver resolv;
+
+	/* user@example.com @mailserver */
+	if (server)
+	{
+		const char* domain = server;
+
+		char buf[sizeof(struct in6_addr)];
+		if (IsUnixAddress(domain) ||
+				inet_pton(AF_INET, domain, &buf) == 1 || inet_pton(AF_INET6, domain, &buf) == 1)
+			address.push_back(domain);
+		else
+		{
+			/* resolve as A/AAAA */
+			if (!resolv.Lookup(domain, Resolver::RR_A, address))
+				if (debug) fprintf(stderr, "warning: failed to resolve "
+						"A for %s\n", domain);
+			if (!resolv.Lookup(domain, Resolver::RR_AAAA, address))
+				if (debug) fprintf(stderr, "warning: failed to resolve "
+						"AAAA for %s\n", domain);
+			/* could not resolve, try to use address */
+			if (address.empty())
+				address.push_back(domain);
+		}
+	} else
+	{
+		/* use mailaddress as mx */
+		const char* domain = strrchr(opts.smtp_rcpt, '@');
+
+		/* no domain, abort! */
+		if (!domain)
+			usage(APP_NAME, stderr, 2);
+
+		/* jmp past '@' */
+		domain += 1;
+
+		/* resolve as MX, with A/AAAA fallback */
+		vector<string> mx;
+		if (!resolv.Lookup(domain, Resolver::RR_MX, mx))
+		{
+			/* if dns failed, we should not try A/AAAA,
+			   only if no data is returned */
+			fprintf(stderr, "failed to resolve %s\n", domain);
+		} else
+		{
+			/* no data, try A/AAAAA */
+			if (mx.empty())
+			{
+				if (debug) fprintf(stderr, " no mx, failling "
+					"back on A/AAAA record for %s\n",
+					domain);
+
+				if (!resolv.Lookup(domain, Resolver::RR_A,
+					address))
+					if (debug) fprintf(stderr, "failed to "
+						"resolve A for %s\n", domain);
+				if (!resolv.Lookup(domain, Resolver::RR_AAAA,
 					address))
 					if (debug) fprintf(stderr, "failed to "
 						"resolve AAAA for %s\n",
@@ -439,399 +1245,2650 @@ int main(int argc, char* argv[])
 			}
 		}
 	}
+}
 
-#ifdef SUPPORT_RATE
-	sem_t* sem = (sem_t*)mmap(NULL, sizeof(sem_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	size_t* counter = (size_t*)mmap(NULL, sizeof(size_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	if (sem == MAP_FAILED || counter == MAP_FAILED) {
-		fprintf(stderr, "mmap: failed\n");
-		return 1;
-	}
-	if (sem_init(sem, 1, 1) != 0)
-		fprintf(stderr, "sem_init: failed\n");
-	*counter = 0;
+/*
+ * Control: shared between the parent and its workers, used to limit the
+ *          number of active workers and to pace the offered rate
+ */
+struct Control
+{
+	volatile unsigned int active;	/* workers with id < active may run */
+	volatile unsigned int stop;
+	volatile double rate;		/* offered msgs/s, 0 means unpaced */
+	volatile double epoch;		/* start of pacing or replay (ms) */
+	unsigned long ticket;		/* next pacing slot */
+	unsigned long replay;		/* next trace entry */
+	volatile unsigned int phase;	/* current scenario phase */
+	unsigned long setup;		/* next --pool-ramp slot */
+	unsigned int ready;		/* workers done with --pool setup */
+	unsigned int exited;		/* forked workers that have returned */
+};
+
+/*
+ * SharedAlloc: zeroed memory that is shared with forked workers
+ */
+static void* SharedAlloc(size_t size)
+{
+#ifdef SUPPORT_SHARED
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
 #else
-	if (show_rate) {
-		fprintf(stderr, "-r is not supported on this platform\n");
-		return 1;
-	}
+	return calloc(1, size);
 #endif
+}
 
-	unsigned int child = 1;
-	if (forks > 0) {
-#ifdef __WIN32__
-		fprintf(stderr, "-P is not supported on this platform\n");
-		return 1;
-#else
-		pid_t pid;
-		for (; child <= forks; ++child) {
-			pid = fork();
-			if (pid == 0)
-				goto spawn;
-			if (pid < 0)
-				fprintf(stderr, "fork() failed\n");
+/*
+ * Collect: merge the statistics of all workers
+ */
+static void Collect(const Statistics* stats, unsigned int workers,
+		Statistics& result)
+{
+	result.Clear();
+	for (unsigned int w = 0; w < workers; ++w)
+		result.Merge(stats[w]);
+}
+
+/*
+ * PrintSizeClasses: show the latency of each message size class
+ */
+static void PrintSizeClasses(const Workload& workload, const Statistics& stats)
+{
+	for (size_t c = 0; c < workload.sizes.size(); ++c)
+	{
+		const SizeClassStatistics& s = stats.size_class[c];
+		if (!s.messages)
+			continue;
+		printf("size %u KiB: %llu messages, datasent "
+			"min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms, total "
+			"p50/p99 = %.2lf/%.2lf ms\n", workload.sizes[c],
+			(unsigned long long)s.messages,
+			s.datasent.Min(), s.datasent.Mean(), s.datasent.Max(),
+			s.datasent.Percentile(99), s.total.Percentile(50),
+			s.total.Percentile(99));
+	}
+}
+
+/*
+ * PrintTransfers: show the transfer paths used, when greeting with EHLO
+ */
+static void PrintTransfers(const Statistics& stats)
+{
+	for (size_t t = 0; t < TRANSFER_MAX; ++t)
+		if (stats.transfer[t])
+			printf("transfer %s: %llu messages\n", SMTPTransferName[t],
+				(unsigned long long)stats.transfer[t]);
+}
+
+/*
+ * PrintPool: show the --pool connection setup apart from the transactions
+ *            over the open connections
+ */
+static void PrintPool(const Statistics& stats)
+{
+	if (!stats.setup.Count())
+		return;
+	printf("setup min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms "
+		"(%llu connections)\n", stats.setup.Min(), stats.setup.Mean(),
+		stats.setup.Max(), stats.setup.Percentile(99),
+		(unsigned long long)stats.setup.Count());
+	printf("transaction min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms\n",
+		stats.total.Min(), stats.total.Mean(), stats.total.Max(),
+		stats.total.Percentile(99));
+}
+
+/*
+ * PrintFamilies: show the connect latency over IPv4 and IPv6, and how
+ *                often each was connected over (won the race)
+ */
+static void PrintFamilies(const Statistics& stats)
+{
+	static const char* name[Statistics::FAMILY_MAX] = { "IPv4", "IPv6" };
+	uint64_t connections = 0;
+	for (size_t f = 0; f < Statistics::FAMILY_MAX; ++f)
+		connections += stats.family[f].Count();
+	for (size_t f = 0; f < Statistics::FAMILY_MAX; ++f)
+	{
+		const Histogram& h = stats.family[f];
+		if (!h.Count())
+			continue;
+		printf("connect %s min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms "
+			"(%llu connections, %.0lf%%)\n", name[f], h.Min(), h.Mean(),
+			h.Max(), h.Percentile(99), (unsigned long long)h.Count(),
+			h.Count() * 100.0 / connections);
+	}
+}
+
+/*
+ * PrintFastOpen: note that the connect and banner times are merged when
+ *                connections were greeted in the SYN (--tcp-fastopen)
+ */
+static void PrintFastOpen(const Statistics& stats)
+{
+	if (stats.fastopen)
+		printf("connect and banner merged: the handshake is in the banner "
+			"time (%llu connections with fast open)\n",
+			(unsigned long long)stats.fastopen);
+}
+
+/*
+ * PrintStatistics: show min/avg/max/p99 of each phase
+ */
+static void PrintStatistics(const Statistics& stats)
+{
+	for (size_t p = 0; p < PHASE_MAX; ++p)
+	{
+		const Histogram& h = stats.phase[p];
+		printf("%s min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms\n",
+			SMTPPhaseName[p], h.Min(), h.Mean(), h.Max(),
+			h.Percentile(99));
+	}
+	PrintFastOpen(stats);
+	if (stats.lag.Count())
+		printf("lag min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms\n",
+			stats.lag.Min(), stats.lag.Mean(), stats.lag.Max(),
+			stats.lag.Percentile(99));
+	if (stats.chunk.Count())
+		printf("bdat min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms "
+			"(%llu chunks)\n", stats.chunk.Min(), stats.chunk.Mean(),
+			stats.chunk.Max(), stats.chunk.Percentile(99),
+			(unsigned long long)stats.chunk.Count());
+	if (stats.recipient.Count())
+		printf("rcpt delivery min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms "
+			"(%llu recipients)\n", stats.recipient.Min(),
+			stats.recipient.Mean(), stats.recipient.Max(),
+			stats.recipient.Percentile(99),
+			(unsigned long long)stats.recipient.Count());
+	PrintPool(stats);
+	PrintTransfers(stats);
+}
+
+/*
+ * PrintWorkers: show the throughput of each worker (and its cpu), so that
+ *               imbalance between them is visible
+ */
+static void PrintWorkers(const Options& opts, const Statistics* stats,
+		unsigned int workers, double elapsed)
+{
+	printf("\n--- %s SMTP per-worker statistics ---\n", opts.smtp_rcpt);
+	double slowest = 0, fastest = 0;
+	for (unsigned int w = 0; w < workers; ++w)
+	{
+		double rate = elapsed > 0 ? stats[w].messages / elapsed : 0;
+		printf("worker %u (cpu %d): %llu messages, %.2lf msgs/s, "
+			"p99 %.2lf ms\n", w, opts.cpus[w % opts.cpus.size()],
+			(unsigned long long)stats[w].messages, rate,
+			stats[w].total.Percentile(99));
+		if (w == 0 || rate < slowest)
+			slowest = rate;
+		if (rate > fastest)
+			fastest = rate;
+	}
+	if (fastest > 0)
+		printf("imbalance: slowest worker at %.0lf%% of the fastest\n",
+			slowest * 100 / fastest);
+}
+
+/*
+ * Throttle: wait until this worker is active and its pacing slot is due
+ *           return false if the run is stopped meanwhile
+ */
+static bool Throttle(Control* control, unsigned int id)
+{
+	while (id >= control->active)
+	{
+		if (abort_ping || control->stop)
+			return false;
+		usleep(10000);
+	}
+	if (control->rate > 0)
+	{
+		unsigned long ticket = __sync_fetch_and_add(&control->ticket, 1);
+		double due = control->epoch + ticket * 1000.0 / control->rate;
+		double now;
+		while ((now = GetHighResTime()) < due)
+		{
+			if (abort_ping || control->stop)
+				return false;
+			usleep(due - now > 100 ? 100000 : (due - now) * 1000);
 		}
-#ifdef SUPPORT_RATE
-		while (show_rate && !abort_ping) {
-			sem_wait(sem);
-			printf("%zu\n", *counter);
-			*counter = 0;
-			sem_post(sem);
-			sleep(1);
+	}
+	return !abort_ping && !control->stop;
+}
+
+/*
+ * SetRate: change the offered rate, keeping the pacing schedule where it
+ *          is so that a rate ramp neither bursts nor stalls
+ */
+static void SetRate(Control* control, double rate)
+{
+	double now = GetHighResTime();
+	double slot = control->rate > 0 ?
+		(now - control->epoch) * control->rate / 1000.0 : control->ticket;
+	if (rate > 0)
+		control->epoch = now - slot * 1000.0 / rate;
+	control->rate = rate;
+}
+
+/*
+ * Message: what to send in one transaction
+ */
+struct Message
+{
+	const string* data;
+	const char* from;
+	string sender;		/* from, when generated */
+	vector<string> rcpts;
+	int size_class;		/* --size-mix class, or -1 */
+};
+
+/*
+ * GenerateAddresses: draw the sender and recipients of message, if they
+ *                    are generated
+ */
+static void GenerateAddresses(const Options& opts, Random& random,
+		Message& message)
+{
+	if (opts.from_pattern.Any())
+	{
+		message.sender = opts.from_pattern.Next(random);
+		message.from = message.sender.c_str();
+	}
+	if (opts.rcpt_pattern.Any())
+		for (size_t r = 0; r < message.rcpts.size(); ++r)
+			message.rcpts[r] = opts.rcpt_pattern.Next(random);
+}
+
+/*
+ * NextMessage: pick the message to send, for --replay wait until the next
+ *              trace entry is due; false when there is nothing left to send
+ */
+static bool NextMessage(const Options& opts, const Workload& workload,
+		Control* control, Random& random, Statistics& stats,
+		Message& message)
+{
+	message.size_class = -1;
+	if (workload.trace.empty())
+	{
+		message.data = &workload.data;
+		message.from = opts.smtp_from;
+		message.rcpts.assign(1, opts.smtp_rcpt);
+
+		/* pick a size class by weight, from the scenario phase's mix */
+		const SizeMix* mix = &workload.size_mix;
+		if (!workload.scenario.empty() &&
+				workload.scenario[control->phase].size_mix.total)
+			mix = &workload.scenario[control->phase].size_mix;
+		if (mix->total)
+		{
+			unsigned int r = random.Next() % mix->total;
+			size_t c = 0;
+			while (r >= mix->weight[c])
+				r -= mix->weight[c++];
+			message.data = &workload.size_bodies[mix->size_class[c]];
+			message.size_class = mix->size_class[c];
+		}
+		GenerateAddresses(opts, random, message);
+		return true;
+	}
+
+	unsigned long next = __sync_fetch_and_add(&control->replay, 1);
+	if (next >= workload.trace.size())
+		return false;
+	const TraceEntry& entry = workload.trace[next];
+	double due = control->epoch + entry.offset / opts.speed, now;
+	while ((now = GetHighResTime()) < due)
+	{
+		if (abort_ping || control->stop)
+			return false;
+		usleep(due - now > 100 ? 100000 : (due - now) * 1000);
+	}
+	stats.lag.Add(now - due);
+
+	message.data = &workload.bodies[entry.body];
+	message.from = entry.sender.c_str();
+	message.rcpts.assign(entry.rcpts, opts.smtp_rcpt);
+	GenerateAddresses(opts, random, message);
+	return true;
+}
+
+/*
+ * RecordFamily: add the connect time of session to that of the address
+ *               family it connected over
+ */
+static void RecordFamily(Statistics& stats, const Session& session)
+{
+	double t = session.GetTime(PHASE_CONNECT);
+	if (t >= 0 && session.GetFamily() == AF_INET)
+		stats.family[Statistics::FAMILY_IPV4].Add(t);
+	else if (t >= 0 && session.GetFamily() == AF_INET6)
+		stats.family[Statistics::FAMILY_IPV6].Add(t);
+}
+
+/*
+ * Record: add the timings of a (possibly failed) ping to stats, for --pool
+ *         only those of the transaction (see RecordSetup)
+ */
+static void Record(Statistics& stats, const Session& session, bool ok,
+		const Message& message, bool pooled)
+{
+	for (size_t p = pooled ? PHASE_MAILFROM : 0; p < PHASE_MAX; ++p)
+	{
+		double t = session.GetTime((SMTPPhase)p);
+		if (t >= 0)
+			stats.phase[p].Add(t);
+	}
+	if (!pooled)
+		RecordFamily(stats, session);
+	const vector<double>& chunks = session.GetChunkTimes();
+	for (size_t c = 0; c < chunks.size(); ++c)
+		stats.chunk.Add(chunks[c]);
+	const vector<double>& rcpts = session.GetRecipientTimes();
+	for (size_t r = 0; r < rcpts.size(); ++r)
+		stats.recipient.Add(rcpts[r]);
+	if (ok)
+	{
+		double total = pooled ? session.GetTime(PHASE_DATASENT) :
+			session.GetTotalTime();
+		stats.total.Add(total);
+		stats.messages++;
+		if (message.size_class >= 0)
+		{
+			SizeClassStatistics& c = stats.size_class[message.size_class];
+			c.datasent.Add(session.GetTime(PHASE_DATASENT));
+			c.total.Add(total);
+			c.messages++;
 		}
+	} else
+	{
+		stats.errors++;
+		stats.failed[session.GetFailedPhase()]++;
+		size_t code = session.GetReply();
+		if (code >= 400 && code < 400 + Statistics::REPLY_CODES)
+			stats.failed_code[code - 400]++;
+		if (code / 100 == 4)
+			stats.deferred++;
+		else if (code / 100 == 5)
+			stats.rejected++;
+	}
+}
+
+/*
+ * RecordSetup: add the timings of opening a --pool connection to stats
+ */
+static void RecordSetup(Statistics& stats, const Session& session)
+{
+	for (size_t p = PHASE_CONNECT; p < PHASE_MAILFROM; ++p)
+		stats.phase[p].Add(session.GetTime((SMTPPhase)p));
+	stats.setup.Add(session.GetTime(PHASE_CONNECT) +
+			session.GetTime(PHASE_HELO));
+	RecordFamily(stats, session);
+}
+
+/*
+ * RecordEvent: add a transaction to the --record flight recorder
+ */
+static void RecordEvent(Recorder& recorder, unsigned int id,
+		unsigned int seq, size_t target, const Session& session, bool ok,
+		const Message& message, bool pooled, double started)
+{
+	Event event;
+	memset(&event, 0, sizeof event);
+	event.start = started;
+	for (size_t p = 0; p < PHASE_MAX; ++p)
+		event.time[p] = session.GetTime((SMTPPhase)p);
+	event.total = !ok ? -1 : pooled ? session.GetTime(PHASE_DATASENT) :
+		session.GetTotalTime();
+	event.worker = id;
+	event.seq = seq;
+	event.bytes = message.data->size();
+	event.rcpts = message.rcpts.size();
+	event.reply = session.GetReply();
+	event.failed = ok ? PHASE_MAX : session.GetFailedPhase();
+	event.target = target;
+	event.transfer = session.GetTransfer();
+	event.flags = (pooled ? EVENT_POOLED : 0) |
+		(session.GetFamily() == AF_INET ? EVENT_IPV4 : 0) |
+		(session.GetFamily() == AF_INET6 ? EVENT_IPV6 : 0);
+	recorder.Add(event);
+}
+
+/*
+ * IsTemporary: whether a failure may succeed if retried later, a 5xx reply
+ *              is permanent while a 4xx reply (such as 421 or 451) or a
+ *              lost connection is not
+ */
+static bool IsTemporary(const Session& session)
+{
+	return session.GetReply() / 100 != 5;
+}
+
+/*
+ * Backoff: the delay (ms) before retrying after the given number of
+ *          consecutive temporary failures, doubling from --backoff min up
+ *          to max, with half of it random so that workers don't retry in
+ *          lockstep
+ */
+static double Backoff(const Options& opts, Random& random,
+		unsigned int failures)
+{
+	double delay = opts.backoff_min;
+	for (unsigned int f = 1; f < failures && delay < opts.backoff_max; ++f)
+		delay *= 2;
+	if (delay > opts.backoff_max)
+		delay = opts.backoff_max;
+	return delay / 2 + random.Uniform() * delay / 2;
+}
+
+/*
+ * Wait: sleep for ms, false if the run is stopped meanwhile
+ */
+static bool Wait(Control* control, double ms)
+{
+	double due = GetHighResTime() + ms, now;
+	while ((now = GetHighResTime()) < due)
+	{
+		if (abort_ping || control->stop)
+			return false;
+#ifdef __WIN32__
+		Sleep(due - now > 100 ? 100 : due - now);
+#else
+		usleep(due - now > 100 ? 100000 : (due - now) * 1000);
 #endif
-		while ((pid = waitpid(-1, NULL, 0))) {
-			if (errno == ECHILD) {
-				break;
-			}
+	}
+	return !abort_ping && !control->stop;
+}
+
+/*
+ * PrintOutcome: show how the attempts ended, and the goodput (delivered
+ *               messages) next to the attempt rate
+ */
+static void PrintOutcome(const Statistics& stats, double elapsed)
+{
+	uint64_t attempts = stats.messages + stats.errors;
+	printf("%llu attempts: %llu delivered, %llu deferred (4xx), "
+		"%llu rejected (5xx), %llu other errors\n",
+		(unsigned long long)attempts, (unsigned long long)stats.messages,
+		(unsigned long long)stats.deferred,
+		(unsigned long long)stats.rejected,
+		(unsigned long long)(stats.errors - stats.deferred -
+			stats.rejected));
+	if (elapsed > 0)
+		printf("goodput %.2lf msgs/s, attempt rate %.2lf/s\n",
+			stats.messages / elapsed, attempts / elapsed);
+}
+
+/*
+ * Profile: sample the cpu time, preemptions and (on Linux) scheduling
+ *          delay of this worker process, since base was sampled
+ */
+static void Profile(ClientStatistics& client, const ClientStatistics& base)
+{
+#ifndef __WIN32__
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+	{
+		client.user_us = ru.ru_utime.tv_sec * 1000000ULL +
+			ru.ru_utime.tv_usec - base.user_us;
+		client.system_us = ru.ru_stime.tv_sec * 1000000ULL +
+			ru.ru_stime.tv_usec - base.system_us;
+		client.preempted = ru.ru_nivcsw - base.preempted;
+	}
+#endif
+#ifdef __linux__
+	/* time on the cpu, then waiting on a run queue (ns) */
+	FILE* fp = fopen("/proc/self/schedstat", "r");
+	if (fp)
+	{
+		unsigned long long run, delay;
+		if (fscanf(fp, "%llu %llu", &run, &delay) == 2)
+			client.run_delay_us = delay / 1000 - base.run_delay_us;
+		fclose(fp);
+	}
+#endif
+}
+
+/*
+ * Account: move the system calls and bytes of a session to stats
+ */
+static void Account(Statistics& stats, Session& session)
+{
+	const SessionCounters& counters = session.GetCounters();
+	stats.client.syscalls += counters.syscalls;
+	stats.client.sent += counters.sent;
+	stats.client.received += counters.received;
+	session.ClearCounters();
+}
+
+/*
+ * ClientBound: why smtpping, rather than the server, limited the
+ *              throughput of workers over elapsed seconds of stats, empty
+ *              if it didn't: the workers were (nearly) out of cpu time, or
+ *              spent a tenth of it waiting for a cpu
+ */
+static string ClientBound(const Statistics& stats, unsigned int workers,
+		double elapsed)
+{
+	if (elapsed <= 0 || workers == 0)
+		return "";
+	const ClientStatistics& c = stats.client;
+	unsigned int cpus = GetCPUCount();
+	double busy = (c.user_us + c.system_us) / 1000000.0 /
+		(elapsed * (workers < cpus ? workers : cpus));
+	double delay = c.run_delay_us / 1000000.0 / (elapsed * workers);
+	char buf[128];
+	if (busy >= 0.9)
+		snprintf(buf, sizeof buf, "cpu %.0lf%% busy", busy * 100);
+	else if (delay >= 0.1)
+		snprintf(buf, sizeof buf, "workers waited %.0lf%% of the time for "
+			"a cpu", delay * 100);
+	else
+		return "";
+	return buf;
+}
+
+/*
+ * PrintClient: show what the run cost smtpping, and warn if it was the
+ *              bottleneck
+ */
+static void PrintClient(const Statistics& stats, unsigned int workers,
+		double elapsed)
+{
+	if (elapsed <= 0)
+		return;
+	const ClientStatistics& c = stats.client;
+	unsigned int cpus = GetCPUCount();
+	unsigned int usable = workers < cpus ? workers : cpus;
+	uint64_t attempts = stats.messages + stats.errors;
+	printf("client cpu %.0lf%% of %u (user %.0lf%%, system %.0lf%%), "
+		"run delay %.0lf%%, %llu preempted, %.1lf syscalls/msg, "
+		"sent %.2lf MB/s, received %.2lf MB/s\n",
+		(c.user_us + c.system_us) / 10000.0 / (elapsed * usable), usable,
+		c.user_us / 10000.0 / (elapsed * usable),
+		c.system_us / 10000.0 / (elapsed * usable),
+		c.run_delay_us / 10000.0 / (elapsed * workers),
+		(unsigned long long)c.preempted,
+		attempts ? (double)c.syscalls / attempts : 0,
+		c.sent / 1000000.0 / elapsed, c.received / 1000000.0 / elapsed);
+	string bound = ClientBound(stats, workers, elapsed);
+	if (!bound.empty())
+		printf("warning: smtpping is the bottleneck (%s), the throughput "
+			"is its limit, not the server's\n", bound.c_str());
+}
+
+/*
+ * ChooseTransfer: BDAT for -C, or with --auto the fastest path the server
+ *                 announced, pipelined when possible
+ */
+static SMTPTransfer ChooseTransfer(const Options& opts,
+		const SMTPCapabilities& caps)
+{
+	if (!opts.auto_transfer && !opts.chunking)
+		return TRANSFER_DATA;
+	if (opts.auto_transfer ? caps.chunking : opts.chunking)
+		return caps.pipelining ? TRANSFER_BDAT_PIPELINING : TRANSFER_BDAT;
+	return caps.pipelining ? TRANSFER_DATA_PIPELINING : TRANSFER_DATA;
+}
+
+/*
+ * RaceCandidates: the addresses of target to race with --happy-eyeballs,
+ *                 IPv6 first then alternating families (RFC 8305), and
+ *                 how to show them; resolved is to be freed
+ */
+static void RaceCandidates(const Options& opts, const Target& target,
+		const struct addrinfo* bindIP, vector<struct addrinfo*>& resolved,
+		vector<const struct addrinfo*>& candidates, string& peer)
+{
+	vector<const struct addrinfo*> family[2];
+	vector<string> name[2];
+	for (size_t i = 0; i < target.address.size(); ++i)
+	{
+		if (IsUnixAddress(target.address[i]))
+			continue;
+		struct addrinfo hints, *res;
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(target.address[i].c_str(), target.port.c_str(),
+					&hints, &res) != 0)
+			continue;
+		resolved.push_back(res);
+		if ((opts.proto && res->ai_family != (int)opts.proto) ||
+				(bindIP && bindIP->ai_family != res->ai_family))
+			continue;
+		size_t f = res->ai_family == AF_INET6 ? 0 : 1;
+		family[f].push_back(res);
+		name[f].push_back("[" + target.address[i] + "]:" + target.port);
+	}
+	for (size_t i = 0; i < family[0].size() || i < family[1].size(); ++i)
+		for (size_t f = 0; f < 2; ++f)
+			if (i < family[f].size())
+			{
+				candidates.push_back(family[f][i]);
+				peer += (peer.empty() ? "" : " or ") + name[f][i];
+			}
+}
+
+/*
+ * Open: connect and greet, with EHLO unless address is known to reject it,
+ *       showing what it announced the first time
+ */
+static bool Open(const Options& opts, Session& session,
+		const vector<const struct addrinfo*>& res,
+		const struct addrinfo* bind, const string& address,
+		std::map<string, SMTPCapabilities>& capabilities, bool ehlo,
+		Statistics& stats)
+{
+	bool ok = res.size() > 1 ?
+		session.Race(res, bind, opts.attempt_delay, address.c_str()) :
+		session.Connect(res[0], bind, address.c_str());
+	if (session.IsConnected())
+		stats.connections++;
+	if (session.IsConnected() && session.IsFastOpen())
+		stats.fastopen++;
+
+	std::map<string, SMTPCapabilities>::const_iterator
+		known = capabilities.find(address);
+	ok = ok && session.Greet(opts.smtp_helo, ehlo &&
+			(known == capabilities.end() || known->second.esmtp));
+	if (ok && ehlo)
+	{
+		const SMTPCapabilities& caps = session.GetCapabilities();
+		if (known == capabilities.end() && !opts.quiet)
+			printf("%s: %s, transfer %s\n", address.c_str(),
+				caps.Describe().c_str(),
+				SMTPTransferName[ChooseTransfer(opts, caps)]);
+		/* a rejected EHLO is remembered, not retried */
+		if (known == capabilities.end() || caps.esmtp)
+			capabilities[address] = caps;
+	}
+	return ok;
+}
+
+/*
+ * WarmUp: wait for this worker's --pool-ramp slot
+ */
+static bool WarmUp(const Options& opts, Control* control)
+{
+	if (opts.pool_ramp <= 0)
+		return !abort_ping && !control->stop;
+	unsigned long slot = __sync_fetch_and_add(&control->setup, 1);
+	return Wait(control, control->epoch + slot * 1000.0 / opts.pool_ramp -
+			GetHighResTime());
+}
+
+/*
+ * Warm: tell that this worker's --pool connection is set up, and wait for
+ *       the others; the last one restarts the pacing (and the clock of the
+ *       run) so that setup isn't part of it. A worker that returned before
+ *       getting here never will, so the run is stopped.
+ */
+static bool Warm(Control* control, unsigned int workers)
+{
+	if (__sync_add_and_fetch(&control->ready, 1) == workers)
+		control->epoch = GetHighResTime();
+	while (control->ready < workers)
+	{
+		if (abort_ping || control->stop)
+			return false;
+		if (control->exited > 0)
+		{
+			if (__sync_bool_compare_and_swap(&control->stop, 0, 1))
+				fprintf(stderr, "setup: a worker exited before the "
+						"pool was set up\n");
+			return false;
+		}
+		usleep(1000);
+	}
+	return !abort_ping && !control->stop;
+}
+
+/*
+ * Worker: ping the first working address until done or aborted
+ */
+static int Worker(const Options& opts, const Target& target,
+		const Workload& workload, unsigned int id, Statistics* stats,
+		Control* control, Recorder* recorder)
+{
+	const vector<string>& address = target.address;
+
+	struct addrinfo *bindIP = NULL, bindIPTmp;
+	if (opts.smtp_bind)
+	{
+		memset(&bindIPTmp, 0, sizeof bindIPTmp);
+		bindIPTmp.ai_family = AF_UNSPEC;
+		bindIPTmp.ai_socktype = SOCK_STREAM;
+		int r = getaddrinfo(opts.smtp_bind, 0, &bindIPTmp, &bindIP);
+		if (r != 0)
+		{
+			fprintf(stderr, "getaddrinfo() failed %s: %s\n",
+					opts.smtp_bind, gai_strerror(r));
+			return 1;
+		}
+	}
+
+	/* pin to a cpu, and touch our statistics first so that they are
+	   allocated on its node */
+	if (!opts.cpus.empty())
+	{
+		int cpu = opts.cpus[id % opts.cpus.size()];
+		if (!PinCPU(cpu))
+			fprintf(stderr, "worker %u: failed to pin to cpu %d\n", id, cpu);
+		stats[id].Clear();
+	}
+
+	/* each worker has its own ring */
+	IOUring* ring = NULL;
+#ifdef HAVE_IO_URING
+	if (opts.io_uring)
+	{
+		ring = new IOUring;
+		if (!ring->Setup())
+		{
+			delete ring;
+			ring = NULL;
+		}
+	}
+#endif
+
+	/* what each target announced, to skip EHLO where it's rejected */
+	std::map<string, SMTPCapabilities> capabilities;
+	bool ehlo = opts.chunking || opts.auto_transfer || opts.lmtp;
+
+	/* each worker makes its own random choices */
+	Random random(Random::Substream(opts.seed, id));
+
+	/* consecutive temporary failures, for --backoff */
+	unsigned int failures = 0;
+
+	/* our own resource use, from here on */
+	ClientStatistics base = ClientStatistics();
+	Profile(base, ClientStatistics());
+	double profiled = 0;
+
+	/* with --pool the connection is kept open between transactions, and
+	   only reopened after a failure */
+	Session* pooled = opts.pool ? new Session(ring, opts.lmtp) : NULL;
+	if (pooled)
+		pooled->SetSocketOptions(opts.sockopts);
+	bool warm = false;
+
+	/* --happy-eyeballs races the addresses on every connect instead */
+	vector<struct addrinfo*> resolved;
+	vector<const struct addrinfo*> race;
+	string racing;
+	if (opts.happy_eyeballs)
+		RaceCandidates(opts, target, bindIP, resolved, race, racing);
+	bool raced = false;
+
+	/* connect to the first working address */
+	unsigned int smtp_seq = 0;
+	double smtp_start = GetHighResTime();
+	vector<string>::const_iterator i;
+	for(i = address.begin(); i != address.end(); ++i)
+	{
+		struct addrinfo *res = NULL, resTmp;
+		bool unix_socket = IsUnixAddress(*i);
+
+		if (unix_socket)
+		{
+#ifdef __WIN32__
+			fprintf(stderr, "%s: Unix sockets are not supported on this "
+				"platform\n", i->c_str());
+			continue;
+#else
+			static struct sockaddr_un sun;
+			if (!UnixAddress(*i, sun, resTmp))
+			{
+				fprintf(stderr, "%s: invalid socket path\n", i->c_str());
+				continue;
+			}
+			res = &resTmp;
+#endif
+		} else
+		{
+			memset(&resTmp, 0, sizeof resTmp);
+			resTmp.ai_family = AF_UNSPEC;
+			resTmp.ai_socktype = SOCK_STREAM;
+			int r = getaddrinfo(i->c_str(), target.port.c_str(), &resTmp,
+					&res);
+			if (r != 0)
+			{
+				fprintf(stderr, "getaddrinfo() failed %s: %s\n",
+					i->c_str(), gai_strerror(r));
+				continue;
+			}
+
+			if ((opts.proto && res->ai_family != (int)opts.proto) ||
+					(bindIP && bindIP->ai_family != res->ai_family))
+			{
+				freeaddrinfo(res);
+				continue;
+			}
+		}
+
+		/* the first address raced stands for all of them */
+		vector<const struct addrinfo*> candidates(1, res);
+		if (!unix_socket && race.size() > 1)
+		{
+			freeaddrinfo(res);
+			if (raced)
+				continue;
+			raced = true;
+			candidates = race;
+		}
+
+		/* print header */
+		string peer = unix_socket ? *i : candidates.size() > 1 ? racing :
+			"[" + *i + "]:" + target.port;
+		if (!opts.quiet && opts.replay)
+		printf("REPLAY %s (%s): %zu messages from %s\n",
+			opts.smtp_rcpt, peer.c_str(),
+			workload.trace.size(), opts.replay);
+		else if (!opts.quiet)
+		printf("PING %s (%s): %d bytes (%s DATA)\n",
+			opts.smtp_rcpt, peer.c_str(),
+			(unsigned int)workload.data.size(),
+			opts.lmtp ? "LMTP" : "SMTP");
+
+		bool next_address = false;
+		for (;;)
+		{
+			/* abort by ctrl+c or if smtp_seq is done */
+			if (abort_ping || control->stop ||
+					(opts.smtp_probes && smtp_seq >= opts.smtp_probes))
+				break;
+
+			/* or if --duration has passed */
+			if (opts.duration > 0 &&
+					GetHighResTime() - smtp_start >= opts.duration * 1000.0)
+				break;
+
+			/* sleep between smtp_req, unless following a trace or
+			   a scenario */
+			if (smtp_seq > 0 && !opts.replay && !opts.scenario)
+			{
+#ifdef __WIN32__
+				Sleep(opts.smtp_probe_wait);
+#else
+				usleep(opts.smtp_probe_wait * 1000);
+#endif
+			}
+
+			/* only increase if smtp_req > 0 */
+			if (smtp_seq > 0)
+				smtp_seq++;
+
+			/* open the --pool connection up front, and wait for the
+			   whole pool before sending */
+			if (pooled && !warm)
+			{
+				warm = true;
+				if (WarmUp(opts, control))
+				{
+					if (Open(opts, *pooled, candidates, unix_socket ?
+								NULL : bindIP, *i, capabilities, ehlo,
+								stats[id]))
+						RecordSetup(stats[id], *pooled);
+					else
+						fprintf(stderr, "setup: %s\n",
+								pooled->GetError().c_str());
+				}
+				if (!Warm(control, opts.forks > 0 ? opts.forks : 1))
+					break;
+				smtp_start = GetHighResTime();
+			}
+
+			if (!Throttle(control, id))
+				break;
+
+			Message message;
+			if (!NextMessage(opts, workload, control, random, stats[id],
+						message))
+				break;
+
+			double started = GetHighResTime();
+			Session fresh(ring, opts.lmtp);
+			fresh.SetSocketOptions(opts.sockopts);
+			Session& session = pooled ? *pooled : fresh;
+			bool ok = true;
+			if (session.IsOpen())
+				session.Begin();
+			else
+			{
+				ok = Open(opts, session, candidates, unix_socket ? NULL :
+						bindIP, *i, capabilities, ehlo, stats[id]);
+				if (ok && pooled)
+					RecordSetup(stats[id], session);
+			}
+
+			/* if it's working, start smtp_req */
+			if (session.IsConnected() && smtp_seq == 0)
+				smtp_seq = 1;
+
+			ok = ok && session.Transaction(message.from, message.rcpts,
+						*message.data,
+						ChooseTransfer(opts, session.GetCapabilities()),
+						opts.chunk_size * 1024) &&
+				(pooled || session.Quit());
+			Record(stats[id], session, ok, message, pooled != NULL);
+			Account(stats[id], session);
+			if (started - profiled >= 100)
+			{
+				Profile(stats[id].client, base);
+				profiled = started;
+			}
+			if (recorder)
+				RecordEvent(*recorder, id, smtp_seq, target.id,
+						session, ok, message, pooled != NULL, started);
+			if (ok && ehlo)
+				stats[id].transfer[session.GetTransfer()]++;
+			if (session.IsConnected() && !session.IsOpen())
+				stats[id].closed++;
+
+			if (!ok)
+			{
+				/* never connected, try the next address */
+				if (smtp_seq == 0 && !session.IsConnected())
+				{
+					fprintf(stderr, "seq=%u: %s\n", smtp_seq,
+							session.GetError().c_str());
+					next_address = true;
+					break;
+				}
+				/* back off from a server that is deferring us, rather
+				   than measuring our own retries */
+				if (opts.backoff_min && IsTemporary(session))
+				{
+					double delay = Backoff(opts, random, ++failures);
+					fprintf(stderr, "seq=%u: %s, retrying in %.0lf ms\n",
+							smtp_seq, session.GetError().c_str(), delay);
+					if (!Wait(control, delay))
+						break;
+					continue;
+				}
+				fprintf(stderr, "seq=%u: %s\n", smtp_seq,
+						session.GetError().c_str());
+				continue;
+			}
+			failures = 0;
+
+			/* print statistics */
+			if (!opts.quiet && pooled)
+			printf("seq=%u, mailfrom=%.2lf ms, rcptto=%.2lf ms, "
+				"datasent=%.2lf ms\n",
+					smtp_seq,
+					session.GetTime(PHASE_MAILFROM),
+					session.GetTime(PHASE_RCPTTO),
+					session.GetTime(PHASE_DATASENT)
+				  );
+			else if (!opts.quiet)
+			printf("seq=%u, connect=%.2lf ms, helo=%.2lf ms, "
+				"mailfrom=%.2lf ms, rcptto=%.2lf ms, datasent=%.2lf ms, "
+				"quit=%.2lf ms\n",
+					smtp_seq,
+					session.GetTime(PHASE_CONNECT),
+					session.GetTime(PHASE_HELO),
+					session.GetTime(PHASE_MAILFROM),
+					session.GetTime(PHASE_RCPTTO),
+					session.GetTime(PHASE_DATASENT),
+					session.GetTime(PHASE_QUIT)
+				  );
+		}
+		if (!unix_socket && candidates.size() == 1)
+			freeaddrinfo(res);
+		if (!next_address)
+			break;
+	}
+	for (size_t r = 0; r < resolved.size(); ++r)
+		freeaddrinfo(resolved[r]);
+
+	Profile(stats[id].client, base);
+
+	/* if we successfully connected somewhere */
+	if (opts.forks > 1 || opts.scenario)
+		;
+	else if (i != address.end() && smtp_seq > 0)
+	{
+		double elapsed = (GetHighResTime() - smtp_start) / 1000.0;
+		printf("\n--- %s SMTP ping statistics ---\n", i->c_str());
+		printf("%u e-mail messages transmitted\n", smtp_seq);
+		PrintOutcome(stats[id], elapsed);
+
+		for (size_t p = 0; p < PHASE_MAX; ++p)
+		{
+			const Histogram& h = stats[id].phase[p];
+			printf("%s min/avg/max = %.2lf/%.2lf/%.2lf ms\n",
+				SMTPPhaseName[p], h.Count() ? h.Min() : -1,
+				h.Mean(), h.Count() ? h.Max() : -1);
+		}
+		PrintFastOpen(stats[id]);
+		const Histogram& chunk = stats[id].chunk;
+		if (chunk.Count())
+			printf("bdat min/avg/max = %.2lf/%.2lf/%.2lf ms (%llu chunks)\n",
+				chunk.Min(), chunk.Mean(), chunk.Max(),
+				(unsigned long long)chunk.Count());
+		const Histogram& rcpt = stats[id].recipient;
+		if (rcpt.Count())
+			printf("rcpt delivery min/avg/max = %.2lf/%.2lf/%.2lf ms "
+				"(%llu recipients)\n", rcpt.Min(), rcpt.Mean(), rcpt.Max(),
+				(unsigned long long)rcpt.Count());
+		PrintPool(stats[id]);
+		if (opts.happy_eyeballs)
+			PrintFamilies(stats[id]);
+		PrintTransfers(stats[id]);
+		PrintSizeClasses(workload, stats[id]);
+		PrintClient(stats[id], 1, elapsed);
+	} else
+	{
+		printf("\n--- no pings were sent ---\n");
+	}
+	if (pooled)
+	{
+		if (pooled->IsOpen())
+		{
+			pooled->Quit();
+			Account(stats[id], *pooled);
+			stats[id].closed++;
+		}
+		delete pooled;
+	}
+#ifdef HAVE_IO_URING
+	delete ring;
+#endif
+	return 0;
+}
+
+/*
+ * TimeLookup: one --dns lookup, counted by how it went
+ */
+static bool TimeLookup(Resolver& resolver, const string& name,
+		Resolver::RecordType type, vector<string>& result,
+		DNSStatistics& stats, double& ms)
+{
+	double start = GetHighResTime();
+	bool ok = resolver.Lookup(name, type, result);
+	ms = GetHighResTime() - start;
+
+	stats.queries++;
+	stats.latency.Add(ms);
+	if (resolver.GetLastSize())
+	{
+		stats.answers++;
+		stats.bytes += resolver.GetLastSize();
+		if (resolver.GetLastSize() > stats.max_bytes)
+			stats.max_bytes = resolver.GetLastSize();
+	}
+	switch (resolver.GetLastStatus())
+	{
+		case Resolver::STATUS_OK:
+			break;
+		case Resolver::STATUS_NXDOMAIN:
+			stats.nxdomain++;
+			break;
+		case Resolver::STATUS_SERVFAIL:
+			stats.servfail++;
+			break;
+		case Resolver::STATUS_TIMEOUT:
+			stats.timeouts++;
+			break;
+		default:
+			stats.errors++;
+			break;
+	}
+	return ok;
+}
+
+static const char* const DNSRecordName[] = { "MX", "A", "AAAA" };
+static const char* const DNSStatusName[] = { "ok", "NXDOMAIN", "SERVFAIL",
+	"timeout", "error" };
+
+/*
+ * PrintDNS: latency, failures and answer sizes per record type
+ */
+static void PrintDNS(const Statistics& stats, double elapsed)
+{
+	uint64_t probes = stats.messages + stats.errors;
+	printf("%llu probes, %llu failed", (unsigned long long)probes,
+		(unsigned long long)stats.errors);
+	if (elapsed > 0)
+		printf(", %.2lf probes/s", probes / elapsed);
+	printf("\n");
+	for (size_t t = 0; t < Resolver::RR_MAX; ++t)
+	{
+		const DNSStatistics& d = stats.dns[t];
+		if (!d.queries)
+			continue;
+		printf("%s min/avg/p99/max = %.2lf/%.2lf/%.2lf/%.2lf ms, "
+			"%llu queries, %llu nxdomain, %llu servfail, %llu timeouts, "
+			"%llu errors, answer avg/max = %llu/%llu bytes\n",
+			DNSRecordName[t], d.latency.Min(), d.latency.Mean(),
+			d.latency.Percentile(99), d.latency.Max(),
+			(unsigned long long)d.queries,
+			(unsigned long long)d.nxdomain,
+			(unsigned long long)d.servfail,
+			(unsigned long long)d.timeouts,
+			(unsigned long long)d.errors,
+			(unsigned long long)(d.answers ? d.bytes / d.answers : 0),
+			(unsigned long long)d.max_bytes);
+	}
+}
+
+/*
+ * Probe: resolve the recipient domain's MX, then A/AAAA of its exchangers
+ *        (of the domain without MX) the way ResolveAddress does, until
+ *        done or aborted; -P runs that many probes concurrently
+ */
+static int Probe(const Options& opts, unsigned int id, Statistics* stats,
+		Control* control)
+{
+	const char* domain = strrchr(opts.smtp_rcpt, '@');
+	domain = domain ? domain + 1 : opts.smtp_rcpt;
+
+	Resolver resolver;
+	if (opts.dns_server && !resolver.SetServer(opts.dns_server,
+				atoi(opts.smtp_port)))
+	{
+		fprintf(stderr, "%s: not an IPv4 name server\n", opts.dns_server);
+		return 1;
+	}
+
+	if (!opts.quiet)
+		printf("DNS %s (%s): MX, then A/AAAA\n", domain, opts.dns_server ?
+			(string("[") + opts.dns_server + "]:" + opts.smtp_port).c_str() :
+			"system resolver");
+
+	unsigned int seq = 0;
+	double start = GetHighResTime();
+	for (;;)
+	{
+		if (abort_ping || control->stop ||
+				(opts.smtp_probes && seq >= opts.smtp_probes))
+			break;
+		if (opts.duration > 0 &&
+				GetHighResTime() - start >= opts.duration * 1000.0)
+			break;
+		if (seq > 0)
+		{
+#ifdef __WIN32__
+			Sleep(opts.smtp_probe_wait);
+#else
+			usleep(opts.smtp_probe_wait * 1000);
+#endif
+		}
+		if (!Throttle(control, id))
+			break;
+		seq++;
+
+		DNSStatistics* dns = stats[id].dns;
+		vector<string> mx;
+		double mx_ms, ms, a_ms = 0, aaaa_ms = 0;
+		string failed;
+		Resolver::Status status = Resolver::STATUS_OK;
+		if (!TimeLookup(resolver, domain, Resolver::RR_MX, mx,
+					dns[Resolver::RR_MX], mx_ms))
+		{
+			/* like ResolveAddress, only no data falls back on A/AAAA */
+			failed = string("MX ") + domain;
+			status = resolver.GetLastStatus();
+		} else
+		{
+			vector<string> hosts = mx;
+			if (hosts.empty())
+				hosts.push_back(domain);
+			for (size_t h = 0; h < hosts.size(); ++h)
+			{
+				for (int t = Resolver::RR_A; t <= Resolver::RR_AAAA; ++t)
+				{
+					vector<string> address;
+					Resolver::RecordType type = (Resolver::RecordType)t;
+					if (!TimeLookup(resolver, hosts[h], type, address,
+								dns[type], ms) && failed.empty())
+					{
+						failed = string(DNSRecordName[type]) + " " + hosts[h];
+						status = resolver.GetLastStatus();
+					}
+					(type == Resolver::RR_A ? a_ms : aaaa_ms) += ms;
+				}
+			}
+		}
+
+		if (!failed.empty())
+		{
+			stats[id].errors++;
+			fprintf(stderr, "seq=%u: %s: %s\n", seq, failed.c_str(),
+					DNSStatusName[status]);
+			continue;
+		}
+		stats[id].messages++;
+
+		if (!opts.quiet)
+		printf("seq=%u, mx=%.2lf ms (%zu exchangers), a=%.2lf ms, "
+			"aaaa=%.2lf ms\n", seq, mx_ms, mx.size(), a_ms, aaaa_ms);
+	}
+
+	if (opts.forks <= 1)
+	{
+		printf("\n--- %s DNS statistics ---\n", opts.smtp_rcpt);
+		PrintDNS(stats[id], (GetHighResTime() - start) / 1000.0);
+	}
+	return 0;
+}
+
+/*
+ * Saturate: raise concurrency (or offered rate) in steps, hold each step and
+ *           stop at the knee, where throughput stops rising or p99 is over
+ *           the slo, then show the sustainable rate
+ */
+static void Saturate(const Options& opts, Statistics* stats,
+		unsigned int workers, Control* control)
+{
+	printf("SATURATE %s: %s %u..%u step %u, %u s per step",
+		opts.smtp_rcpt, opts.saturate_rate ? "rate" : "concurrency",
+		opts.saturate_min, opts.saturate_max, opts.saturate_step,
+		opts.saturate_hold);
+	if (opts.slo > 0)
+		printf(", p99 SLO %.2lf ms", opts.slo);
+	printf("\n%6s %10s %10s %10s %10s %8s\n", "step",
+		opts.saturate_rate ? "offered/s" : "workers",
+		"msgs/s", "p50 ms", "p99 ms", "errors");
+	fflush(stdout);
+
+	Statistics* before = new Statistics;
+	Statistics* after = new Statistics;
+	unsigned int step = 0, best_level = 0;
+	double best_rate = 0, best_p99 = 0;
+	const char* knee = NULL;
+	string bound;	/* of the last step */
+	for (unsigned int level = opts.saturate_min;
+			level <= opts.saturate_max && !abort_ping;
+			level += opts.saturate_step)
+	{
+		++step;
+		if (opts.saturate_rate)
+		{
+			control->ticket = 0;
+			control->epoch = GetHighResTime();
+			control->rate = level;
+			control->active = workers;
+		} else
+			control->active = level;
+
+		Collect(stats, workers, *before);
+		double start = GetHighResTime();
+		while (!abort_ping &&
+				GetHighResTime() - start < opts.saturate_hold * 1000.0)
+			usleep(100000);
+		Collect(stats, workers, *after);
+		double elapsed = (GetHighResTime() - start) / 1000.0;
+		after->Subtract(*before);
+
+		double rate = elapsed > 0 ? after->messages / elapsed : 0;
+		double p99 = after->total.Percentile(99);
+		printf("%6u %10u %10.2lf %10.2lf %10.2lf %8llu\n", step, level,
+			rate, after->total.Percentile(50), p99,
+			(unsigned long long)after->errors);
+		bound = ClientBound(*after, opts.saturate_rate ? workers : level,
+				elapsed);
+		if (!bound.empty())
+			printf("%6s warning: smtpping is the bottleneck (%s)\n", "",
+				bound.c_str());
+		fflush(stdout);
+		if (abort_ping)
+			break;
+
+		if (opts.slo > 0 &&
+				(p99 > opts.slo || after->total.Count() == 0))
+		{
+			knee = "p99 over SLO";
+			break;
+		}
+		/* an offered rate is only sustained if the server keeps up */
+		if (opts.saturate_rate && rate < level * 0.95)
+		{
+			knee = "throughput below offered rate";
+			break;
+		}
+		bool rising = !best_level || rate >= best_rate * 1.05;
+		if (rate > best_rate)
+		{
+			best_level = level;
+			best_rate = rate;
+			best_p99 = p99;
+		}
+		if (!rising)
+		{
+			knee = "throughput stopped rising";
+			break;
+		}
+	}
+	delete before;
+	delete after;
+
+	printf("\n--- %s SMTP saturation search ---\n", opts.smtp_rcpt);
+	if (knee)
+	{
+		printf("knee at step %u: %s\n", step, knee);
+		if (!bound.empty())
+			printf("warning: smtpping was the bottleneck at the knee (%s), "
+				"it is its limit, not the server's\n", bound.c_str());
+	} else
+		printf("no knee found%s\n", abort_ping ? " (aborted)" : "");
+	if (best_level)
+		printf("sustainable rate %.2lf msgs/s at %s %u (p99 %.2lf ms)\n",
+			best_rate, opts.saturate_rate ? "offered rate" : "concurrency",
+			best_level, best_p99);
+	else
+		printf("no sustainable rate found\n");
+}
+
+/*
+ * Adapt: additive-increase/multiplicative-decrease of the number of active
+ *        workers, backing off on 4xx replies, p99 over the slo or phase
+ *        latency inflated to twice its lowest median, then show the
+ *        concurrency it converged on
+ */
+static void Adapt(const Options& opts, Statistics* stats,
+		unsigned int workers, Control* control)
+{
+	printf("ADAPTIVE %s: 1..%u workers, %.2lf s interval", opts.smtp_rcpt,
+		workers, opts.interval);
+	if (opts.slo > 0)
+		printf(", p99 SLO %.2lf ms", opts.slo);
+	printf("\n%8s %8s %10s %10s %8s  %s\n", "time", "workers", "msgs/s",
+		"p99 ms", "deferred", "action");
+	fflush(stdout);
+
+	Statistics* before = new Statistics;
+	Statistics* current = new Statistics;
+	Statistics* delta = new Statistics;
+	double baseline[PHASE_MAX];
+	for (size_t p = 0; p < PHASE_MAX; ++p)
+		baseline[p] = -1;
+
+	unsigned int active = 1;
+	control->active = active;
+
+	/* the levels after the first decrease make up the AIMD sawtooth */
+	unsigned int converged_num = 0, converged_min = 0, converged_max = 0;
+	double converged_sum = 0;
+
+	double start = GetHighResTime();
+	Collect(stats, workers, *before);
+	while (!abort_ping && (opts.duration <= 0 ||
+				GetHighResTime() - start < opts.duration * 1000.0))
+	{
+		double t = GetHighResTime();
+		while (!abort_ping && GetHighResTime() - t < opts.interval * 1000.0)
+			usleep(opts.interval < 0.1 ? opts.interval * 1000000 : 100000);
+		double elapsed = (GetHighResTime() - t) / 1000.0;
+
+		Collect(stats, workers, *current);
+		*delta = *current;
+		delta->Subtract(*before);
+		*before = *current;
+
+		string reason;
+		if (delta->deferred)
+			reason = "4xx replies";
+		else if (opts.slo > 0 && delta->total.Count() &&
+				delta->total.Percentile(99) > opts.slo)
+			reason = "p99 over SLO";
+		else
+		{
+			for (size_t p = 0; p < PHASE_MAX; ++p)
+			{
+				if (!delta->phase[p].Count())
+					continue;
+				double p50 = delta->phase[p].Percentile(50);
+				if (baseline[p] < 0 || p50 < baseline[p])
+					baseline[p] = p50;
+				else if (p50 > baseline[p] * 2 && p50 - baseline[p] > 1)
+				{
+					reason = string(SMTPPhaseName[p]) + " latency";
+					break;
+				}
+			}
+		}
+
+		if (converged_num || !reason.empty())
+		{
+			if (!converged_num || active < converged_min)
+				converged_min = active;
+			if (active > converged_max)
+				converged_max = active;
+			converged_sum += active;
+			converged_num++;
+		}
+
+		unsigned int level = active;
+		string action = "hold";
+		if (!reason.empty())
+		{
+			active = active / 2 > 0 ? active / 2 : 1;
+			action = "decrease (" + reason + ")";
+		} else if (delta->messages && active < workers)
+		{
+			active++;
+			action = "increase";
+		}
+		control->active = active;
+
+		printf("%8.1lf %8u %10.2lf %10.2lf %8llu  %s\n",
+			(GetHighResTime() - start) / 1000.0, level,
+			elapsed > 0 ? delta->messages / elapsed : 0,
+			delta->total.Percentile(99),
+			(unsigned long long)delta->deferred, action.c_str());
+		fflush(stdout);
+	}
+	delete before;
+	delete current;
+	delete delta;
+
+	printf("\n--- %s SMTP adaptive concurrency ---\n", opts.smtp_rcpt);
+	if (converged_num)
+		printf("converged concurrency %.1lf (range %u..%u over %u"
+			" intervals)\n", converged_sum / converged_num,
+			converged_min, converged_max, converged_num);
+	else
+		printf("did not converge, no congestion up to %u workers\n",
+			active);
+}
+
+/*
+ * Monitor: every --report interval show the throughput, active connections,
+ *          p50/p99 of each phase and the errors by phase and reply code,
+ *          until all workers are done
+ */
+static void Monitor(const Options& opts, Statistics* stats,
+		unsigned int workers)
+{
+	printf("REPORT %s: %u workers, every %.2lf s, p50/p99 in ms\n",
+		opts.smtp_rcpt, workers, opts.report);
+	printf("%8s %10s %6s %6s %5s", "time", "msgs/s", "active", "errors",
+		"cpu");
+	for (size_t p = 0; p < PHASE_MAX; ++p)
+		printf(" %13s", SMTPPhaseName[p]);
+	printf(" %13s\n", "total");
+	unsigned int cpus = GetCPUCount();
+	fflush(stdout);
+
+	Statistics* before = new Statistics;
+	Statistics* current = new Statistics;
+	Statistics* delta = new Statistics;
+
+	unsigned int running = workers;
+	double start = GetHighResTime();
+	Collect(stats, workers, *before);
+	while (running > 0)
+	{
+		double t = GetHighResTime();
+		while (running > 0 && GetHighResTime() - t < opts.report * 1000.0)
+		{
+			usleep(opts.report < 0.1 ? opts.report * 1000000 : 100000);
+			while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+				running--;
+		}
+		double elapsed = (GetHighResTime() - t) / 1000.0;
+
+		/* each worker only writes its own statistics, deltas are taken
+		   from merged snapshots */
+		Collect(stats, workers, *current);
+		*delta = *current;
+		delta->Subtract(*before);
+		*before = *current;
+
+		printf("%8.1lf %10.2lf %6llu %6llu", (GetHighResTime() - start) /
+			1000.0, elapsed > 0 ? delta->messages / elapsed : 0,
+			(unsigned long long)(current->connections > current->closed ?
+				current->connections - current->closed : 0),
+			(unsigned long long)delta->errors);
+		printf(" %4.0lf%%", elapsed > 0 ? (delta->client.user_us +
+				delta->client.system_us) / 10000.0 /
+			(elapsed * (workers < cpus ? workers : cpus)) : 0);
+		for (size_t p = 0; p <= PHASE_MAX; ++p)
+		{
+			const Histogram& h = p < PHASE_MAX ? delta->phase[p] :
+				delta->total;
+			char buf[32];
+			if (h.Count())
+				snprintf(buf, sizeof buf, "%.2lf/%.2lf", h.Percentile(50),
+					h.Percentile(99));
+			else
+				snprintf(buf, sizeof buf, "-");
+			printf(" %13s", buf);
+		}
+		printf("\n");
+		if (delta->errors)
+		{
+			printf("%8s errors:", "");
+			const char* sep = " ";
+			for (size_t p = 0; p < PHASE_MAX; ++p)
+				if (delta->failed[p])
+				{
+					printf("%s%s %llu", sep, SMTPPhaseName[p],
+						(unsigned long long)delta->failed[p]);
+					sep = ", ";
+				}
+			sep = "; ";
+			for (size_t c = 0; c < Statistics::REPLY_CODES; ++c)
+				if (delta->failed_code[c])
+				{
+					printf("%s%zu %llu", sep, c + 400,
+						(unsigned long long)delta->failed_code[c]);
+					sep = ", ";
+				}
+			printf("\n");
+		}
+		string bound = ClientBound(*delta, workers, elapsed);
+		if (!bound.empty())
+			printf("%8s warning: smtpping is the bottleneck (%s)\n", "",
+				bound.c_str());
+		fflush(stdout);
+	}
+	delete before;
+	delete current;
+	delete delta;
+}
+
+/*
+ * FormatRamp: "value" or "from..to" of a scenario phase
+ */
+static string FormatRamp(const double ramp[2])
+{
+	char buf[64];
+	if (ramp[0] == ramp[1])
+		snprintf(buf, sizeof buf, "%g", ramp[0]);
+	else
+		snprintf(buf, sizeof buf, "%g..%g", ramp[0], ramp[1]);
+	return buf;
+}
+
+/*
+ * RunScenario: go through the phases of a --scenario, ramping the active
+ *              workers and the offered rate of each phase without
+ *              restarting the workers, and show the statistics per phase
+ */
+static void RunScenario(const Options& opts, const Workload& workload,
+		Statistics* stats, unsigned int workers, Control* control)
+{
+	const vector<ScenarioPhase>& scenario = workload.scenario;
+	printf("SCENARIO %s: %zu phases from %s\n", opts.smtp_rcpt,
+		scenario.size(), opts.scenario);
+	printf("%-12s %8s %10s %10s %10s %10s %10s %8s %8s\n", "phase",
+		"time", "workers", "rate", "msgs/s", "p50 ms", "p99 ms",
+		"errors", "deferred");
+	fflush(stdout);
+
+	vector<Statistics*> result;
+	vector<double> result_elapsed;
+	Statistics* before = new Statistics;
+	Collect(stats, workers, *before);
+	double scenario_start = GetHighResTime();
+	for (size_t p = 0; p < scenario.size() && !abort_ping; ++p)
+	{
+		const ScenarioPhase& phase = scenario[p];
+		bool paced = phase.rate[0] > 0 || phase.rate[1] > 0;
+		control->phase = p;
+
+		double start = GetHighResTime(), now;
+		while (!abort_ping &&
+				(now = GetHighResTime()) - start < phase.duration * 1000.0)
+		{
+			/* ramp linearly from the first to the second value */
+			double f = (now - start) / (phase.duration * 1000.0);
+			double rate = phase.rate[0] + (phase.rate[1] - phase.rate[0]) * f;
+			if (paced && rate < 0.1)
+				rate = 0.1;
+			if (rate != control->rate)
+				SetRate(control, rate);
+			control->active = phase.concurrency[0] +
+				(phase.concurrency[1] - phase.concurrency[0]) * f + 0.5;
+
+			double left = phase.duration * 1000.0 - (now - start);
+			usleep(left < 100 ? left * 1000 : 100000);
+		}
+		double elapsed = (GetHighResTime() - start) / 1000.0;
+
+		Statistics* delta = new Statistics;
+		Collect(stats, workers, *delta);
+		Statistics* current = new Statistics;
+		*current = *delta;
+		delta->Subtract(*before);
+		delete before;
+		before = current;
+		result.push_back(delta);
+		result_elapsed.push_back(elapsed);
+
+		printf("%-12s %8.1lf %10s %10s %10.2lf %10.2lf %10.2lf %8llu %8llu\n",
+			phase.name.c_str(),
+			(GetHighResTime() - scenario_start) / 1000.0,
+			FormatRamp(phase.concurrency).c_str(),
+			paced ? FormatRamp(phase.rate).c_str() : "-",
+			elapsed > 0 ? delta->messages / elapsed : 0,
+			delta->total.Percentile(50), delta->total.Percentile(99),
+			(unsigned long long)delta->errors,
+			(unsigned long long)delta->deferred);
+		fflush(stdout);
+	}
+	delete before;
+
+	printf("\n--- %s SMTP scenario statistics ---\n", opts.smtp_rcpt);
+	for (size_t p = 0; p < result.size(); ++p)
+	{
+		const Statistics& s = *result[p];
+		printf("%sphase %s: %.2lf s, %llu e-mail messages transmitted, "
+			"%llu errors (%llu deferred), %.2lf msgs/s\n", p ? "\n" : "",
+			scenario[p].name.c_str(), result_elapsed[p],
+			(unsigned long long)s.messages,
+			(unsigned long long)s.errors,
+			(unsigned long long)s.deferred,
+			result_elapsed[p] > 0 ? s.messages / result_elapsed[p] : 0);
+		PrintStatistics(s);
+		PrintSizeClasses(workload, s);
+		delete result[p];
+	}
+	if (abort_ping)
+		printf("aborted in phase %s\n",
+			scenario[result.size() - 1].name.c_str());
+}
+
+#ifndef __WIN32__
+static void Save(const Options& opts, const vector<string>& args,
+		const Statistics& stats, unsigned int workers, double elapsed);
+
+/*
+ * Coordinate: hand our command line to --agents agents, start them at once
+ *             and show the merged cluster-wide statistics
+ */
+static int Coordinate(const Options& opts, const vector<string>& args)
+{
+	Coordinator coordinator(APP_VERSION);
+	if (!coordinator.Listen(opts.coordinator))
+	{
+		fprintf(stderr, "coordinator: failed to listen on port %s\n",
+				opts.coordinator);
+		return 1;
+	}
+	printf("COORDINATOR %s: waiting for %u agents on port %s\n",
+		opts.smtp_rcpt, opts.agents, opts.coordinator);
+	fflush(stdout);
+	while (coordinator.GetAgents() < opts.agents && coordinator.Accept())
+	{
+		printf("agent %s connected (%zu/%u)\n",
+			coordinator.GetName(coordinator.GetAgents() - 1).c_str(),
+			coordinator.GetAgents(), opts.agents);
+		fflush(stdout);
+	}
+	if (coordinator.GetAgents() < opts.agents)
+		return 1;
+
+	/* agents start after this delay, so that they start together */
+	const unsigned int delay = 1000;
+	if (!coordinator.Start(args, delay))
+	{
+		fprintf(stderr, "coordinator: failed to start agents\n");
+		return 1;
+	}
+	printf("%8s %8s %10s %8s\n", "time", "agents", "msgs/s", "errors");
+
+	Statistics* previous = new Statistics;
+	Statistics* current = new Statistics;
+	previous->Clear();
+	double start = GetHighResTime() + delay, last = start;
+	bool stopped = false;
+	while (coordinator.Poll(100))
+	{
+		if (abort_ping && !stopped)
+		{
+			coordinator.Stop();
+			stopped = true;
 		}
-		return 0;
-#endif
-	} else if (show_rate) {
-		fprintf(stderr, "-r only works with -P1 or greater\n");
-		return 1;
+		double now = GetHighResTime();
+		if (now - last < 1000)
+			continue;
+		coordinator.Collect(*current);
+		printf("%8.1lf %8zu %10.2lf %8llu\n", (now - start) / 1000.0,
+			coordinator.GetRunning(),
+			(current->messages - previous->messages) * 1000.0 / (now - last),
+			(unsigned long long)(current->errors - previous->errors));
+		fflush(stdout);
+		*previous = *current;
+		last = now;
 	}
-	spawn:
-
-	/* register statistics */
-#define STATS_GLOB(name) \
-	double smtp_##name##_min = -1, smtp_##name##_max = -1,\
-	smtp_##name##_sum = 0 , smtp_##name##_num = 0;
-
-	STATS_GLOB(connect);
-	STATS_GLOB(banner);
-	STATS_GLOB(helo);
-	STATS_GLOB(mailfrom);
-	STATS_GLOB(rcptto);
-	STATS_GLOB(data);
-	STATS_GLOB(datasent);
-	STATS_GLOB(quit);
-
-#define STATS(name, min) \
-	double smtp_##name = GetHighResTime();\
-	if (smtp_##name - smtp_##min < smtp_##name##_min ||\
-	smtp_##name##_min == -1)\
-	smtp_##name##_min = smtp_##name - smtp_##min;\
-	if (smtp_##name - smtp_##min > smtp_##name##_max ||\
-	smtp_##name##_max == -1)\
-	smtp_##name##_max = smtp_##name - smtp_##min;\
-	smtp_##name##_sum += smtp_##name - smtp_##min; smtp_##name##_num++;
-
-#define STATS_TIME(name) \
-	(smtp_##name - smtp_init)
-#define STATS_SESSION_TIME(name) \
-	(smtp_##name - smtp_connect)
+	double elapsed = (GetHighResTime() - start) / 1000.0;
+
+	coordinator.Collect(*current);
+	printf("\n--- %s SMTP cluster statistics ---\n", opts.smtp_rcpt);
+	printf("%zu agents, %llu e-mail messages transmitted, %llu errors, "
+		"%.2lf msgs/s\n", coordinator.GetAgents(),
+		(unsigned long long)current->messages,
+		(unsigned long long)current->errors,
+		elapsed > 0 ? current->messages / elapsed : 0);
+	PrintStatistics(*current);
+	Workload workload;
+	if (BuildSizeMix(opts, opts.size_mix, workload, workload.size_mix))
+		PrintSizeClasses(workload, *current);
+	for (size_t i = 0; i < coordinator.GetAgents(); ++i)
+	{
+		const Statistics& s = coordinator.GetStatistics(i);
+		printf("agent %s: %llu messages, %llu errors, %.2lf msgs/s\n",
+			coordinator.GetName(i).c_str(),
+			(unsigned long long)s.messages,
+			(unsigned long long)s.errors,
+			elapsed > 0 ? s.messages / elapsed : 0);
+	}
+	if (opts.save)
+		Save(opts, args, *current, coordinator.GetAgents(), elapsed);
+	delete previous;
+	delete current;
+	return 0;
+}
 
-	struct addrinfo *bindIP = NULL, bindIPTmp;
-	if (smtp_bind)
+/*
+ * Report: stream statistics to the coordinator until all workers are done
+ */
+static void Report(Agent& agent, Statistics* stats, unsigned int workers,
+		Control* control)
+{
+	Statistics* snapshot = new Statistics;
+	unsigned int running = workers;
+	bool stopping = false;
+	double last = GetHighResTime();
+	while (running > 0)
 	{
-		memset(&bindIPTmp, 0, sizeof bindIPTmp);
-		bindIPTmp.ai_family = AF_UNSPEC;
-		bindIPTmp.ai_socktype = SOCK_STREAM;
-		int r = getaddrinfo(smtp_bind, 0, &bindIPTmp, &bindIP);
-		if (r != 0)
+		/* the coordinator asks us to stop, or went away */
+		if (stopping)
+			usleep(100000);
+		else if (agent.Wait(100))
 		{
-			fprintf(stderr, "getaddrinfo() failed %s: %s\n",
-					smtp_bind, gai_strerror(r));
-			return 1;
+			stopping = true;
+			control->stop = 1;
+		}
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			running--;
+		if (running == 0 || stopping || GetHighResTime() - last < 1000)
+			continue;
+		last = GetHighResTime();
+		Collect(stats, workers, *snapshot);
+		if (!agent.Send(*snapshot, false))
+		{
+			stopping = true;
+			control->stop = 1;
 		}
 	}
+	Collect(stats, workers, *snapshot);
+	agent.Send(*snapshot, true);
+	delete snapshot;
+}
+#endif
 
-	/* connect to the first working address */
-	unsigned int smtp_seq = 0;
-	vector<string>::const_iterator i;
-	for(i = address.begin(); i != address.end(); ++i)
+/*
+ * Replayed: show how well the --replay schedule was kept
+ */
+static void Replayed(const Options& opts, const Workload& workload,
+		const Statistics& stats, double elapsed)
+{
+	const TraceEntry& last = workload.trace.back();
+	printf("\n--- %s SMTP replay statistics ---\n", opts.replay);
+	printf("%zu trace entries, %llu e-mail messages transmitted, "
+		"%llu errors\n", workload.trace.size(),
+		(unsigned long long)stats.messages,
+		(unsigned long long)stats.errors);
+	printf("%.2lf s (trace %.2lf s at speed %.2lf), %.2lf msgs/s\n",
+		elapsed, last.offset / 1000.0, opts.speed,
+		elapsed > 0 ? stats.messages / elapsed : 0);
+	PrintStatistics(stats);
+	if (stats.lag.Percentile(99) > 100)
+		printf("warning: the schedule was not kept, use more workers"
+			" (-P)\n");
+}
+
+/*
+ * Save: write the statistics of the run, and how it was run, to --save
+ */
+static void Save(const Options& opts, const vector<string>& args,
+		const Statistics& stats, unsigned int workers, double elapsed)
+{
+	string command;
+	for (size_t i = 0; i < args.size(); ++i)
+		command += (i ? " " : "") + args[i];
+	time_t now = time(NULL);
+	char date[64];
+	strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+	Result* result = new Result;
+	result->config.push_back(std::make_pair("command", command));
+	result->config.push_back(std::make_pair("date", string(date)));
+	result->config.push_back(std::make_pair("workers",
+				std::to_string(workers)));
+	result->config.push_back(std::make_pair("socket",
+				opts.sockopts.Describe()));
+	result->config.push_back(std::make_pair("seed",
+				std::to_string((unsigned long long)opts.seed)));
+	result->elapsed = elapsed;
+	result->stats = stats;
+	if (!result->Save(opts.save, APP_VERSION))
+		fprintf(stderr, "save: file %s could not be written\n", opts.save);
+	delete result;
+}
+
+/*
+ * Change: relative change from before to after (%)
+ */
+static double Change(double before, double after)
+{
+	return before > 0 ? (after - before) * 100 / before : 0;
+}
+
+/*
+ * PrintTargets: the statistics of each @server side by side, workers take
+ *               turns between them so that worker w sent to target w % n
+ */
+static void PrintTargets(const Options& opts, const vector<string>& names,
+		const Statistics* stats, unsigned int workers, double elapsed)
+{
+	size_t n = names.size();
+	vector<Statistics*> target(n);
+	vector<int> width(n);
+	for (size_t t = 0; t < n; ++t)
 	{
-		struct addrinfo *res = NULL, resTmp;
+		target[t] = new Statistics;
+		target[t]->Clear();
+		for (unsigned int w = t; w < workers; w += n)
+			target[t]->Merge(stats[w]);
+		width[t] = names[t].size() > 15 ? names[t].size() : 15;
+	}
 
-		memset(&resTmp, 0, sizeof resTmp);
-		resTmp.ai_family = AF_UNSPEC;
-		resTmp.ai_socktype = SOCK_STREAM;
-		int r = getaddrinfo(i->c_str(), smtp_port, &resTmp, &res);
-		if (r != 0)
-		{
-			fprintf(stderr, "getaddrinfo() failed %s: %s\n",
-				i->c_str(), gai_strerror(r));
+	printf("\n--- %s SMTP statistics by target ---\n", opts.smtp_rcpt);
+	printf("%-20s", "");
+	for (size_t t = 0; t < n; ++t)
+		printf(" %*s", width[t], names[t].c_str());
+	printf("\n%-20s", "workers");
+	for (size_t t = 0; t < n; ++t)
+		printf(" %*u", width[t],
+			(unsigned int)((workers + n - 1 - t) / n));
+	printf("\n%-20s", "delivered");
+	for (size_t t = 0; t < n; ++t)
+		printf(" %*llu", width[t], (unsigned long long)target[t]->messages);
+	printf("\n%-20s", "errors");
+	for (size_t t = 0; t < n; ++t)
+		printf(" %*llu", width[t], (unsigned long long)target[t]->errors);
+	printf("\n%-20s", "msgs/s");
+	for (size_t t = 0; t < n; ++t)
+		printf(" %*.2lf", width[t], elapsed > 0 ?
+			target[t]->messages / elapsed : 0);
+	printf("\n");
+	for (size_t p = 0; p <= PHASE_MAX; ++p)
+	{
+		bool any = false;
+		for (size_t t = 0; t < n; ++t)
+			any |= (p < PHASE_MAX ? target[t]->phase[p] :
+					target[t]->total).Count() > 0;
+		if (!any)
 			continue;
+		printf("%-12s p50/p99", p < PHASE_MAX ? SMTPPhaseName[p] : "total");
+		for (size_t t = 0; t < n; ++t)
+		{
+			const Histogram& h = p < PHASE_MAX ? target[t]->phase[p] :
+				target[t]->total;
+			char cell[64];
+			snprintf(cell, sizeof cell, "%.2lf/%.2lf", h.Percentile(50),
+				h.Percentile(99));
+			printf(" %*s", width[t], h.Count() ? cell : "-");
 		}
+		printf("\n");
+	}
 
-		if (proto && res->ai_family != proto)
+	/* each against the first, whether its latency differs by more than
+	   chance */
+	const Histogram& first = target[0]->total;
+	for (size_t t = 1; t < n; ++t)
+	{
+		const Histogram& h = target[t]->total;
+		if (!first.Count() || !h.Count())
 			continue;
+		double z, pvalue = h.MannWhitney(first, &z);
+		printf("%s vs %s: total p50 %+.1lf%%, p99 %+.1lf%%, p-value %.2g, "
+			"%s\n", names[t].c_str(), names[0].c_str(),
+			Change(first.Percentile(50), h.Percentile(50)),
+			Change(first.Percentile(99), h.Percentile(99)), pvalue,
+			pvalue >= 0.05 ? "no significant difference" :
+			z > 0 ? "slower" : "faster");
+	}
+	for (size_t t = 0; t < n; ++t)
+		delete target[t];
+}
 
-		if (bindIP && bindIP->ai_family != res->ai_family)
+/*
+ * Compare: compare the throughput and the latency of each phase of two
+ *          saved results; a regression is throughput down, or the p50 or
+ *          p99 of a phase up, by more than --threshold, latency only if
+ *          the shift is significant (Mann-Whitney U, p < 0.05)
+ */
+static int Compare(const Options& opts, const char* baseline,
+		const char* current)
+{
+	Result* result[2] = { new Result, new Result };
+	const char* path[2] = { baseline, current };
+	for (size_t r = 0; r < 2; ++r)
+	{
+		string error;
+		if (!result[r]->Load(path[r], error))
+		{
+			fprintf(stderr, "compare: %s: %s\n", path[r], error.c_str());
+			delete result[0];
+			delete result[1];
+			return 2;
+		}
+	}
+	const Statistics& a = result[0]->stats;
+	const Statistics& b = result[1]->stats;
+
+	printf("COMPARE %s with %s: threshold %.1lf%%\n", baseline, current,
+		opts.threshold);
+	for (size_t r = 0; r < 2; ++r)
+		printf("%-9s %s (%s, %s workers)\n", r ? "current:" : "baseline:",
+			result[r]->Get("command").c_str(),
+			result[r]->Get("date").c_str(),
+			result[r]->Get("workers").c_str());
+
+	unsigned int regressions = 0;
+	double rate[2], error_rate[2];
+	for (size_t r = 0; r < 2; ++r)
+	{
+		const Statistics& s = result[r]->stats;
+		rate[r] = result[r]->elapsed > 0 ?
+			s.messages / result[r]->elapsed : 0;
+		error_rate[r] = s.messages + s.errors ?
+			s.errors * 100.0 / (s.messages + s.errors) : 0;
+	}
+	double change = Change(rate[0], rate[1]);
+	printf("\n%-9s %10s %10s %8s\n", "", "baseline", "current", "change");
+	printf("%-9s %10.2lf %10.2lf %+7.1lf%%  %s\n", "msgs/s", rate[0],
+		rate[1], change, change < -opts.threshold ? "REGRESSION" :
+		change > opts.threshold ? "higher" : "");
+	if (change < -opts.threshold)
+		regressions++;
+	printf("%-9s %9.2lf%% %9.2lf%%\n", "errors", error_rate[0],
+		error_rate[1]);
+
+	printf("\n%-9s %9s %9s %8s %9s %9s %8s %9s\n", "ms", "p50 base",
+		"p50 cur", "change", "p99 base", "p99 cur", "change", "p-value");
+	for (size_t p = 0; p <= PHASE_MAX; ++p)
+	{
+		const Histogram& ha = p < PHASE_MAX ? a.phase[p] : a.total;
+		const Histogram& hb = p < PHASE_MAX ? b.phase[p] : b.total;
+		if (!ha.Count() || !hb.Count())
 			continue;
+		double z, pvalue = hb.MannWhitney(ha, &z);
+		double p50[2] = { ha.Percentile(50), hb.Percentile(50) };
+		double p99[2] = { ha.Percentile(99), hb.Percentile(99) };
+		double c50 = Change(p50[0], p50[1]), c99 = Change(p99[0], p99[1]);
+
+		const char* verdict = "";
+		if (pvalue < 0.05 && z > 0 &&
+				(c50 > opts.threshold || c99 > opts.threshold))
+		{
+			verdict = "REGRESSION";
+			regressions++;
+		} else if (pvalue < 0.05 && z < 0 &&
+				(c50 < -opts.threshold || c99 < -opts.threshold))
+			verdict = "faster";
+		printf("%-9s %9.2lf %9.2lf %+7.1lf%% %9.2lf %9.2lf %+7.1lf%% "
+			"%9.2g  %s\n", p < PHASE_MAX ? SMTPPhaseName[p] : "total",
+			p50[0], p50[1], c50, p99[0], p99[1], c99, pvalue, verdict);
+	}
+	delete result[0];
+	delete result[1];
 
-		/* print header */
-		if (!quiet)
-		printf("PING %s ([%s]:%s): %d bytes (SMTP DATA)\n",
-			smtp_rcpt, i->c_str(), smtp_port,
-			(unsigned int)data.size());
-reconnect:
-
-		/* abort by ctrl+c or if smtp_seq is done */
-		if (abort_ping || (smtp_probes && smtp_seq >= smtp_probes)) {
-			freeaddrinfo(res);
-			break;
-		}
+	if (regressions)
+		printf("\n%u regressions over %.1lf%%\n", regressions,
+			opts.threshold);
+	else
+		printf("\nno regressions over %.1lf%%\n", opts.threshold);
+	return regressions ? 1 : 0;
+}
+
+/*
+ * EventBefore: order events by start time
+ */
+static bool EventBefore(const Event& a, const Event& b)
+{
+	return a.start < b.start;
+}
+
+/*
+ * Decode: turn the events of a --record file, within --window, into CSV
+ *         or a summary with the slowest second (by p99 total latency)
+ */
+static int Decode(const Options& opts, const char* path)
+{
+	Recorder recorder;
+	string error;
+	if (!recorder.Load(path, APP_VERSION, error))
+	{
+		fprintf(stderr, "decode: %s: %s\n", path, error.c_str());
+		return 2;
+	}
+
+	vector<Event> all, events;
+	for (unsigned int w = 0; w < recorder.GetWorkers(); ++w)
+		recorder.GetEvents(w, all);
+	double epoch = recorder.GetEpoch();
+	for (size_t e = 0; e < all.size(); ++e)
+	{
+		double t = (all[e].start - epoch) / 1000.0;
+		if (t >= opts.window_from && (opts.window_to == 0 ||
+					t < opts.window_to))
+			events.push_back(all[e]);
+	}
+	std::sort(events.begin(), events.end(), EventBefore);
 
-		/* sleep between smtp_req */
-		if (smtp_seq > 0)
+	if (opts.csv)
+	{
+		printf("time,worker,seq,target");
+		for (size_t p = 0; p < PHASE_MAX; ++p)
+			printf(",%s", SMTPPhaseName[p]);
+		printf(",total,bytes,rcpts,transfer,family,reply,failed\n");
+		for (size_t e = 0; e < events.size(); ++e)
 		{
-#ifdef __WIN32__
-			Sleep(smtp_probe_wait);
-#else
-			usleep(smtp_probe_wait * 1000);
-#endif
+			const Event& ev = events[e];
+			printf("%.6lf,%u,%u,%s", (ev.start - epoch) / 1000.0, ev.worker,
+				ev.seq, recorder.GetTarget(ev.target).c_str());
+			for (size_t p = 0; p < PHASE_MAX; ++p)
+				if (ev.time[p] >= 0)
+					printf(",%.3f", ev.time[p]);
+				else
+					printf(",");
+			if (ev.total >= 0)
+				printf(",%.3f", ev.total);
+			else
+				printf(",");
+			printf(",%u,%u,%s,%s,%u,%s\n", ev.bytes, ev.rcpts,
+				ev.transfer < TRANSFER_MAX ?
+					SMTPTransferName[ev.transfer] : "",
+				ev.flags & EVENT_IPV6 ? "IPv6" :
+					ev.flags & EVENT_IPV4 ? "IPv4" : "",
+				ev.reply, ev.failed < PHASE_MAX ?
+					SMTPPhaseName[ev.failed] : "");
 		}
+		return 0;
+	}
 
-		/* only increase if smtp_req > 0 */
-		if (smtp_seq > 0)
-			smtp_seq++;
+	if (events.empty())
+	{
+		printf("--- %s: no events ---\n", path);
+		return 0;
+	}
 
-		int s = socket(res->ai_family, res->ai_socktype,
-			res->ai_protocol);
-		if (s == -1)
+	Statistics* stats = new Statistics;
+	stats->Clear();
+	for (size_t e = 0; e < events.size(); ++e)
+	{
+		const Event& ev = events[e];
+		for (size_t p = 0; p < PHASE_MAX; ++p)
+			if (ev.time[p] >= 0)
+				stats->phase[p].Add(ev.time[p]);
+		if (ev.failed >= PHASE_MAX)
 		{
-			fprintf(stderr, "seq=%u: socket() failed\n",
-				smtp_seq);
-			if (smtp_seq == 0) {
-				freeaddrinfo(res);
-				continue;
-			} else {
-				goto reconnect;
-			}
+			stats->messages++;
+			stats->total.Add(ev.total);
+			continue;
 		}
+		stats->errors++;
+		stats->failed[ev.failed]++;
+		if (ev.reply >= 400 && ev.reply < 400 + Statistics::REPLY_CODES)
+			stats->failed_code[ev.reply - 400]++;
+		if (ev.reply / 100 == 4)
+			stats->deferred++;
+		else if (ev.reply / 100 == 5)
+			stats->rejected++;
+	}
 
-		if (bindIP && bind(s, bindIP->ai_addr, bindIP->ai_addrlen) != 0)
+	double first = (events.front().start - epoch) / 1000.0;
+	double last = (events.back().start - epoch) / 1000.0;
+	printf("--- %s: %zu events of %u workers, %.3lf-%.3lf s ---\n", path,
+		events.size(), recorder.GetWorkers(), first, last);
+	PrintOutcome(*stats, last - first);
+	PrintStatistics(*stats);
+	const Histogram& total = stats->total;
+	if (total.Count())
+		printf("total min/avg/max/p99 = %.2lf/%.2lf/%.2lf/%.2lf ms\n",
+			total.Min(), total.Mean(), total.Max(), total.Percentile(99));
+	for (size_t c = 0; c < Statistics::REPLY_CODES; ++c)
+		if (stats->failed_code[c])
+			printf("reply %zu: %llu failed\n", c + 400,
+				(unsigned long long)stats->failed_code[c]);
+	delete stats;
+
+	/* where a spike would be */
+	double slowest = -1, slowest_p99 = 0;
+	size_t slowest_count = 0, slowest_failed = 0;
+	for (size_t e = 0; e < events.size(); )
+	{
+		double second = floor((events[e].start - epoch) / 1000.0);
+		vector<double> totals;
+		size_t count = 0, failed = 0;
+		for (; e < events.size() &&
+				floor((events[e].start - epoch) / 1000.0) == second; ++e)
 		{
-			fprintf(stderr, "seq=%u: bind() failed\n",
-				smtp_seq);
-			if (smtp_seq == 0) {
-				freeaddrinfo(res);
-				continue;
-			} else {
-				goto reconnect;
-			}
+			count++;
+			if (events[e].failed < PHASE_MAX)
+				failed++;
+			else
+				totals.push_back(events[e].total);
+		}
+		if (totals.empty())
+			continue;
+		size_t rank = (totals.size() * 99 + 99) / 100 - 1;
+		std::nth_element(totals.begin(), totals.begin() + rank,
+				totals.end());
+		if (slowest < 0 || totals[rank] > slowest_p99)
+		{
+			slowest = second;
+			slowest_p99 = totals[rank];
+			slowest_count = count;
+			slowest_failed = failed;
 		}
+	}
+	if (slowest >= 0)
+		printf("slowest second: %.0lf-%.0lf s, p99 total %.2lf ms "
+			"(%zu events, %zu failed)\n", slowest, slowest + 1,
+			slowest_p99, slowest_count, slowest_failed);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	/* register signal handlers */
+	signal(SIGINT, sigint_handler);
 
-		/* initiate counters on windows */
 #ifdef __WIN32__
-		StartCounter();
+	/* initialize winsock */
+	WSAData wData;
+	WSAStartup(MAKEWORD(2,2), &wData);
 #endif
 
-		/* start up time */
-		double smtp_init = GetHighResTime();
+	/* no arguments: show help */
+	if (argc < 2)
+		usage(argv[0], stderr, 2);
 
-		/* connect */
-		if (connect(s, res->ai_addr, res->ai_addrlen) != 0) {
-			fprintf(stderr, "seq=%u: connect() failed "
-				"%s\n", smtp_seq, i->c_str());
-			if (smtp_seq == 0) {
-				freeaddrinfo(res);
-				continue;
-			} else {
-				close(s);
-				goto reconnect;
-			}
-		}
-		STATS(connect, init);
+	/* keep the command line for agents, ParseOptions() reorders it */
+	const char* name = argv[0];
+	vector<string> args(argv + 1, argv + argc);
 
-		/* if it's working, start smtp_req */
-		if (smtp_seq == 0)
-			smtp_seq = 1;
+	Options opts;
+	ParseOptions(argc, argv, opts);
 
-		/*
-		 * < SMTP Banner
-		 */
-		string cmd;
-		size_t ret = 0;
-		if (!SMTPReadLine(s, ret) || ret / 100 != 2)
-		{
-			fprintf(stderr, "seq=%u: recv: BANNER failed (%zu)\n",
-				smtp_seq, ret);
-			close(s);
-			goto reconnect;
-		}
-		STATS(banner, connect);
+	/* compare two saved results */
+	if (opts.compare)
+	{
+		if (argc != 2)
+			usage(name, stderr, 2);
+		return Compare(opts, argv[0], argv[1]);
+	}
 
-		/*
-		 * > HELO helo
-		 * < 250 OK
-		 */
-		cmd = string("HELO ") + smtp_helo + "\r\n";
-		if (send(s, cmd.c_str(), cmd.size(), 0) != (int)cmd.size())
-		{
-			fprintf(stderr, "seq=%u: send: failed\n", smtp_seq);
-			close(s);
-			goto reconnect;
-		}
-		if (!SMTPReadLine(s, ret) || ret / 100 != 2)
-		{
-			fprintf(stderr, "seq=%u: recv: HELO failed (%zu)\n",
-				smtp_seq, ret);
-			close(s);
-			goto reconnect;
-		}
-		STATS(helo, connect);
+	/* decode a recorded file */
+	if (opts.decode)
+	{
+		if (argc != 1)
+			usage(name, stderr, 2);
+		return Decode(opts, argv[0]);
+	}
 
-		/*
-		 * > MAIL FROM: <address>
-		 * < 250 OK
-		 */
-		cmd = string("MAIL FROM: <") + smtp_from + ">\r\n";
-		if (send(s, cmd.c_str(), cmd.size(), 0) != (int)cmd.size())
+#ifndef __WIN32__
+	/* agents run the command line of the coordinator */
+	Agent agent(APP_VERSION);
+	vector<string> remote;
+	vector<char*> remote_argv;
+	double agent_start = 0;
+	if (opts.agent)
+	{
+		/* the coordinator may not be up yet */
+		while (!agent.Connect(opts.agent))
 		{
-			fprintf(stderr, "seq=%u: send: failed\n", smtp_seq);
-			close(s);
-			goto reconnect;
+			if (abort_ping)
+				return 1;
+			sleep(1);
 		}
-		if (!SMTPReadLine(s, ret) || ret / 100 != 2)
+		unsigned int stream = 0, delay = 0;
+		if (!agent.Receive(remote, stream, delay))
 		{
-			fprintf(stderr, "seq=%u: recv: MAIL FROM failed (%zu)\n",
-				smtp_seq, ret);
-			close(s);
-			goto reconnect;
+			fprintf(stderr, "agent: failed to get configuration from %s\n",
+					opts.agent);
+			return 1;
 		}
-		STATS(mailfrom, connect);
+		agent_start = GetHighResTime() + delay;
+
+		remote_argv.push_back((char*)name);
+		for (size_t i = 0; i < remote.size(); ++i)
+			remote_argv.push_back(&remote[i][0]);
+		remote_argv.push_back(NULL);
+		argc = remote_argv.size() - 1;
+		argv = &remote_argv[0];
+
+		const char* coordinator = opts.agent;
+		/* -J is ours to set, the coordinator can't lift it */
+		bool safe_mode = opts.safe_mode;
+		opts = Options();
+		opts.safe_mode = safe_mode;
+		ParseOptions(argc, argv, opts);
+		opts.agent = coordinator;
+		opts.coordinator = NULL;
+		opts.show_rate = false;
+		opts.quiet = true;
+		if (opts.forks == 0)
+			opts.forks = 1;
+		opts.seed = Random::Substream(opts.seed, stream);
+	}
+#endif
+
+	/* no e-mail or mx specified */
+	if (argc < 1)
+		usage(name, stderr, 2);
+
+	/* mail address */
+	opts.smtp_rcpt = argv[0];
+
+	/* one seed drives every random choice, added to the command line (of
+	   agents and results) so that the run can be repeated */
+	if (!opts.seeded)
+	{
+		opts.seed = Random::Mix((uint64_t)(GetHighResTime() * 1000) ^
+				getpid());
+		args.insert(args.begin(), std::to_string(
+					(unsigned long long)opts.seed));
+		args.insert(args.begin(), "--seed");
+	}
+	if (!opts.agent && (opts.seeded || !opts.size_mix.empty() ||
+				opts.scenario || opts.backoff_min ||
+				opts.from_pattern.Any() || opts.rcpt_pattern.Any()))
+		printf("SEED %llu\n", (unsigned long long)opts.seed);
 
-		/*
-		 * > RCPT TO: <address>
-		 * < 250 OK
-		 */
-		cmd = string("RCPT TO: <") + smtp_rcpt + ">\r\n";
-		if (send(s, cmd.c_str(), cmd.size(), 0) != (int)cmd.size())
+	if (opts.coordinator || opts.agent)
+	{
+#ifdef __WIN32__
+		fprintf(stderr, "--coordinator and --agent are not supported on "
+				"this platform\n");
+		return 1;
+#else
+		if (opts.saturate || opts.adaptive || opts.scenario ||
+				opts.report > 0 || opts.dns)
 		{
-			fprintf(stderr, "seq=%u: send: failed\n", smtp_seq);
-			close(s);
-			goto reconnect;
+			fprintf(stderr, "--saturate, --adaptive, --scenario, --report "
+					"and --dns can't be distributed\n");
+			return 1;
 		}
-		if (!SMTPReadLine(s, ret) || ret / 100 != 2)
+		if (opts.coordinator)
+			return Coordinate(opts, args);
+#endif
+	}
+
+	if (opts.saturate)
+	{
+		if (!opts.saturate_rate)
+			opts.forks = opts.saturate_max;
+		else if (opts.forks == 0)
 		{
-			fprintf(stderr, "seq=%u: recv: RCPT TO failed (%zu)\n",
-				smtp_seq, ret);
-			close(s);
-			goto reconnect;
+			fprintf(stderr, "--saturate-rate requires -P\n");
+			return 1;
 		}
-		STATS(rcptto, connect);
+	} else if (opts.adaptive)
+		opts.forks = opts.adaptive;
+	if (opts.scenario && (opts.saturate || opts.adaptive || opts.replay))
+	{
+		fprintf(stderr, "--scenario can't be combined with --saturate, "
+				"--adaptive or --replay\n");
+		return 1;
+	}
+	if (opts.dns && (opts.saturate || opts.adaptive || opts.scenario ||
+				opts.replay || opts.pool || opts.report > 0 || opts.record))
+	{
+		fprintf(stderr, "--dns can't be combined with --saturate, "
+				"--adaptive, --scenario, --replay, --pool, --report or "
+				"--record\n");
+		return 1;
+	}
+	/* with TCP_FASTOPEN_CONNECT a connect returns before the SYN is sent,
+	   so there would be nothing to race */
+	if (opts.happy_eyeballs && opts.sockopts.fastopen)
+	{
+		fprintf(stderr, "--happy-eyeballs can't be combined with "
+				"--tcp-fastopen\n");
+		return 1;
+	}
+	if (opts.pool && (opts.saturate || opts.adaptive || opts.scenario))
+	{
+		fprintf(stderr, "--pool can't be combined with --saturate, "
+				"--adaptive or --scenario\n");
+		return 1;
+	}
+	if (opts.report > 0 && (opts.saturate || opts.adaptive ||
+				opts.scenario || opts.show_rate))
+	{
+		fprintf(stderr, "--report can't be combined with --saturate, "
+				"--adaptive, --scenario or -r\n");
+		return 1;
+	}
 
-		if (!chunking)
+	/* place workers on the interface's node, along with the memory for
+	   message bodies and statistics (allocated when first touched) */
+	if (opts.numa)
+	{
+		int node = GetNICNode(opts.numa);
+		vector<int> node_cpus;
+		if (node < 0 || !GetNodeCPUs(node, node_cpus))
+			fprintf(stderr, "%s: no NUMA node, workers are not placed by "
+					"node\n", opts.numa);
+		else
 		{
-			/*
-			 * > DATA
-			 * < 354 Feed me
-			 */
-			cmd = string("DATA\r\n");
-			if (send(s, cmd.c_str(), cmd.size(), 0) != (int)cmd.size())
-			{
-				fprintf(stderr, "seq=%u: send: failed\n", smtp_seq);
-				close(s);
-				goto reconnect;
-			}
-			if (!SMTPReadLine(s, ret) || ret / 100 != 3)
+			vector<int> cpus;
+			for (size_t i = 0; i < node_cpus.size(); ++i)
+				if (opts.cpus.empty() || std::find(opts.cpus.begin(),
+							opts.cpus.end(), node_cpus[i]) != opts.cpus.end())
+					cpus.push_back(node_cpus[i]);
+			if (cpus.empty())
 			{
-				fprintf(stderr, "seq=%u: recv: DATA failed (%zu)\n",
-					smtp_seq, ret);
-				close(s);
-				goto reconnect;
+				fprintf(stderr, "--cpus has no cpus on the NUMA node (%d) "
+						"of %s\n", node, opts.numa);
+				return 1;
 			}
+			opts.cpus = cpus;
+			if (!PreferNode(node))
+				fprintf(stderr, "failed to prefer memory on NUMA node "
+						"%d\n", node);
 		}
-		STATS(data, connect);
+	}
+
+	Workload workload;
+	workload.data = BuildMessage(opts, opts.smtp_file,
+			opts.smtp_data_size * 1024);
+	if (!BuildSizeMix(opts, opts.size_mix, workload, workload.size_mix))
+		return 1;
+	if (opts.replay)
+	{
+		if (!LoadTrace(opts, workload))
+			return 1;
+		/* enough workers to keep up with most traces */
+		if (opts.forks == 0)
+			opts.forks = 16;
+	}
+	if (opts.scenario)
+	{
+		if (!LoadScenario(opts, workload))
+			return 1;
+		/* a worker for the highest concurrency of any phase */
+		opts.forks = 1;
+		for (size_t p = 0; p < workload.scenario.size(); ++p)
+			for (size_t i = 0; i < 2; ++i)
+				if (workload.scenario[p].concurrency[i] + 0.5 > opts.forks)
+					opts.forks = workload.scenario[p].concurrency[i] + 0.5;
+	}
 
-		/*
-		 * > data...
-		 * < ??? Mkay
-		 */
-		if (send(s, data.c_str(), data.size(), 0) != (int)data.size())
+	/* --dns looks up the recipient domain itself, @server is the name
+	   server to ask */
+	vector<Target> targets;
+	vector<string> names;
+	if (opts.dns)
+	{
+		if (argc > 2)
+			usage(name, stderr, 2);
+		if (argc > 1)
 		{
-			fprintf(stderr, "seq=%u: send: failed\n", smtp_seq);
-			close(s);
-			goto reconnect;
+			if (argv[1][0] != '@')
+				usage(name, stderr, 2);
+			opts.dns_server = argv[1] + 1;
 		}
-		if (!SMTPReadLine(s, ret))
+	} else if (argc == 1)
+	{
+		Target target;
+		target.id = 0;
+		target.port = opts.smtp_port;
+		ResolveAddress(opts, NULL, target.address);
+		target.name = strrchr(opts.smtp_rcpt, '@') + 1;
+		targets.push_back(target);
+	} else
+	{
+		for (int a = 1; a < argc; ++a)
 		{
-			fprintf(stderr, "seq=%u: recv: EOM failed (%zu)\n",
-				smtp_seq, ret);
-			close(s);
-			goto reconnect;
+			if (argv[a][0] != '@')
+				usage(name, stderr, 2);
+			Target target;
+			target.id = a - 1;
+			target.name = argv[a] + 1;
+			target.port = opts.smtp_port;
+			string host;
+			SplitPort(target.name, host, target.port);
+			ResolveAddress(opts, host.c_str(), target.address);
+			targets.push_back(target);
 		}
-		STATS(datasent, connect);
+	}
+	for (size_t t = 0; t < targets.size(); ++t)
+		names.push_back(targets[t].name);
 
-		/*
-		 * > QUIT
-		 * < ??? Mkay
-		 */
-		cmd = string("QUIT\r\n");
-		if (send(s, cmd.c_str(), cmd.size(), 0) != (int)cmd.size())
+	/* workers take turns between several targets, so that each gets
+	   the same share of them at the same time */
+	if (targets.size() > 1)
+	{
+		if (opts.saturate || opts.adaptive || opts.scenario ||
+				opts.replay)
+		{
+			fprintf(stderr, "several @servers can't be combined with "
+					"--saturate, --adaptive, --scenario or --replay\n");
+			return 1;
+		}
+		if (opts.record && targets.size() > Recorder::TARGETS)
 		{
-			fprintf(stderr, "seq=%u: send: QUIT failed\n",
-				smtp_seq);
-			close(s);
-			goto reconnect;
+			fprintf(stderr, "--record takes at most %u @servers\n",
+					(unsigned int)Recorder::TARGETS);
+			return 1;
 		}
-		if (!SMTPReadLine(s, ret))
+		if (opts.mirror)
+			opts.forks = (opts.forks ? opts.forks : 1) * targets.size();
+		else if (opts.forks == 0)
+			opts.forks = targets.size();
+		else if (opts.forks % targets.size())
 		{
-			fprintf(stderr, "seq=%u: recv: QUIT failed (%zu)\n",
-				smtp_seq, ret);
-			close(s);
-			goto reconnect;
+			fprintf(stderr, "-P must be a multiple of the number of "
+					"@servers (%zu), or use --mirror\n", targets.size());
+			return 1;
 		}
-		STATS(quit, connect);
-
-		shutdown(s, 2);
-		close(s);
+	}
 
-#ifdef SUPPORT_RATE
-		if (show_rate) {
-			sem_wait(sem);
-			(*counter)++;
-			sem_post(sem);
+	/* fall back on blocking sockets if io_uring can't be used */
+	if (opts.io_uring)
+	{
+#ifdef HAVE_IO_URING
+		IOUring probe;
+		if (!probe.Setup())
+		{
+			fprintf(stderr, "%s, using blocking sockets\n",
+					probe.GetError().c_str());
+			opts.io_uring = false;
 		}
+#else
+		fprintf(stderr, "io_uring is not supported on this platform, "
+				"using blocking sockets\n");
+		opts.io_uring = false;
 #endif
+	}
 
-		/* print statistics */
-		if (!quiet)
-		printf("seq=%u, connect=%.2lf ms, helo=%.2lf ms, "
-			"mailfrom=%.2lf ms, rcptto=%.2lf ms, datasent=%.2lf ms, "
-			"quit=%.2lf ms\n",
-				smtp_seq,
-				STATS_TIME(connect),
-				STATS_SESSION_TIME(helo),
-				STATS_SESSION_TIME(mailfrom),
-				STATS_SESSION_TIME(rcptto),
-				STATS_SESSION_TIME(datasent),
-				STATS_SESSION_TIME(quit)
-			  );
-
-		/* next loop */
-		goto reconnect;
+	/* part of the run header, so that results can be reproduced */
+	if (opts.sockopts.Any() && !opts.agent)
+		printf("SOCKET %s\n", opts.sockopts.Describe().c_str());
+	if (opts.from_pattern.Any() && !opts.agent)
+		printf("FROM %s\n", opts.from_pattern.Describe().c_str());
+	if (opts.rcpt_pattern.Any() && !opts.agent)
+		printf("RCPT %s\n", opts.rcpt_pattern.Describe().c_str());
+
+	unsigned int workers = opts.forks > 0 ? opts.forks : 1;
+	Statistics* stats = (Statistics*)SharedAlloc(sizeof(Statistics) * workers);
+	Control* control = (Control*)SharedAlloc(sizeof(Control));
+	if (!stats || !control) {
+		fprintf(stderr, "mmap: failed\n");
+		return 1;
 	}
 
-	/* if we successfully connected somewhere */
-	if (forks > 1)
-		;
-	else if (i != address.end() && smtp_seq > 0)
-	{
-		printf("\n--- %s SMTP ping statistics ---\n", i->c_str());
-		printf("%u e-mail messages transmitted\n", smtp_seq);
+	/* mapped before forking, so that each worker writes its ring */
+	Recorder* recorder = NULL;
+	if (opts.record) {
+		string error;
+		recorder = new Recorder;
+		if (!recorder->Create(opts.record, APP_VERSION, workers,
+					opts.record_events, names, error)) {
+			fprintf(stderr, "record: %s: %s\n", opts.record,
+				error.c_str());
+			return 1;
+		}
+	}
+	/* saturation search, --adaptive and --scenario activate workers as
+	   they go */
+	control->active = opts.saturate || opts.adaptive || opts.scenario ? 0 :
+		workers;
+
+#ifndef SUPPORT_SHARED
+	if (opts.show_rate || opts.saturate || opts.adaptive || opts.scenario ||
+			opts.report > 0) {
+		fprintf(stderr, "%s is not supported on this platform\n",
+			opts.show_rate ? "-r" : opts.saturate ? "--saturate" :
+			opts.adaptive ? "--adaptive" : opts.scenario ? "--scenario" :
+			"--report");
+		return 1;
+	}
+#endif
 
-#define SHOWSTAT(x) \
-	printf(#x " min/avg/max = %.2lf/%.2lf/%.2lf ms\n", \
-	smtp_##x##_min, smtp_##x##_num>0?smtp_##x##_sum / smtp_##x##_num:0, \
-	smtp_##x##_max);
-
-		SHOWSTAT(connect);
-		SHOWSTAT(banner);
-		SHOWSTAT(helo);
-		SHOWSTAT(mailfrom);
-		SHOWSTAT(rcptto);
-		SHOWSTAT(data);
-		SHOWSTAT(datasent);
-		SHOWSTAT(quit);
-	} else
-	{
-		printf("\n--- no pings were sent ---\n");
+	if (opts.forks > 0) {
+#ifdef __WIN32__
+		fprintf(stderr, "-P is not supported on this platform\n");
+		return 1;
+#else
+		pid_t pid;
+		/* agents start at the time given by the coordinator */
+		if (opts.agent) {
+			double now;
+			while ((now = GetHighResTime()) < agent_start)
+				usleep((agent_start - now) * 1000);
+		}
+		control->epoch = GetHighResTime();
+		if (recorder)
+			recorder->SetEpoch(control->epoch);
+		/* or each worker would print the buffered run header again */
+		fflush(stdout);
+		for (unsigned int child = 0; child < opts.forks; ++child) {
+			pid = fork();
+			if (pid == 0) {
+				int r = opts.dns ? Probe(opts, child, stats, control) :
+					Worker(opts, targets[child % targets.size()],
+						workload, child, stats, control, recorder);
+				__sync_add_and_fetch(&control->exited, 1);
+				return r;
+			}
+			if (pid < 0)
+				fprintf(stderr, "fork() failed\n");
+		}
+		if (opts.saturate) {
+			Saturate(opts, stats, workers, control);
+			control->stop = 1;
+		} else if (opts.adaptive) {
+			Adapt(opts, stats, workers, control);
+			control->stop = 1;
+		} else if (opts.scenario) {
+			RunScenario(opts, workload, stats, workers, control);
+			control->stop = 1;
+		} else if (opts.agent) {
+			Report(agent, stats, workers, control);
+		} else if (opts.report > 0) {
+			Monitor(opts, stats, workers);
+		}
+		/* -r until the workers are done or --duration has passed */
+		unsigned int running = workers;
+		uint64_t last = 0;
+		while (opts.show_rate && !abort_ping && running > 0 &&
+				(opts.duration <= 0 || GetHighResTime() - control->epoch <
+				 opts.duration * 1000.0)) {
+			sleep(1);
+			while (running > 0 && (pid = waitpid(-1, NULL, WNOHANG)) != 0)
+				running = pid > 0 ? running - 1 : 0;
+			uint64_t messages = 0;
+			for (unsigned int w = 0; w < workers; ++w)
+				messages += stats[w].messages;
+			printf("%zu\n", (size_t)(messages - last));
+			last = messages;
+		}
+		while ((pid = waitpid(-1, NULL, 0))) {
+			if (errno == ECHILD) {
+				break;
+			}
+		}
+		if (opts.save && !opts.agent) {
+			Statistics* result = new Statistics;
+			Collect(stats, workers, *result);
+			Save(opts, args, *result, workers,
+				(GetHighResTime() - control->epoch) / 1000.0);
+			delete result;
+		}
+		if (opts.forks > 1 && !opts.agent && !opts.saturate &&
+				!opts.adaptive && !opts.scenario) {
+			Statistics* result = new Statistics;
+			Collect(stats, workers, *result);
+			double elapsed = (GetHighResTime() - control->epoch) / 1000.0;
+			if (opts.dns) {
+				printf("\n--- %s DNS statistics ---\n", opts.smtp_rcpt);
+				PrintDNS(*result, elapsed);
+			} else {
+				printf("\n--- %s SMTP ping statistics ---\n",
+					opts.smtp_rcpt);
+				PrintOutcome(*result, elapsed);
+				PrintPool(*result);
+				if (opts.happy_eyeballs)
+					PrintFamilies(*result);
+				PrintClient(*result, workers, elapsed);
+				if (targets.size() > 1)
+					PrintTargets(opts, names, stats, workers, elapsed);
+			}
+			delete result;
+		}
+		if (!opts.cpus.empty() && opts.forks > 1 && !opts.agent &&
+				!opts.saturate && !opts.adaptive)
+			PrintWorkers(opts, stats, workers,
+				(GetHighResTime() - control->epoch) / 1000.0);
+		if (opts.replay && !opts.agent) {
+			Statistics* result = new Statistics;
+			Collect(stats, workers, *result);
+			Replayed(opts, workload, *result,
+				(GetHighResTime() - control->epoch) / 1000.0);
+			delete result;
+		} else if (!opts.size_mix.empty() && opts.forks > 1 &&
+				!opts.agent && !opts.saturate && !opts.adaptive &&
+				!opts.scenario) {
+			Statistics* result = new Statistics;
+			Collect(stats, workers, *result);
+			printf("\n--- %s SMTP size mix statistics ---\n",
+				opts.smtp_rcpt);
+			PrintSizeClasses(workload, *result);
+			delete result;
+		}
+		delete recorder;
+		return 0;
+#endif
+	} else if (opts.show_rate || opts.report > 0) {
+		fprintf(stderr, "%s only works with -P1 or greater\n",
+			opts.show_rate ? "-r" : "--report");
+		return 1;
 	}
 
+	control->epoch = GetHighResTime();
+	if (recorder)
+		recorder->SetEpoch(control->epoch);
+	int status = opts.dns ? Probe(opts, 0, stats, control) :
+		Worker(opts, targets[0], workload, 0, stats, control, recorder);
+	delete recorder;
+	if (opts.save)
+		Save(opts, args, stats[0], 1,
+			(GetHighResTime() - control->epoch) / 1000.0);
+
 #ifdef __WIN32__
 	if (abort_ping)
 	{
@@ -839,5 +3896,5 @@ reconnect:
 	}
 	WSACleanup();
 #endif
-	return 0;
+	return status;
 }
@@ -0,0 +1,509 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "stats.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <sstream>
+
+using std::string;
+
+void Histogram::Clear()
+{
+	memset((void*)this, 0, sizeof *this);
+}
+
+/*
+ * bucket layout: values below SUB_BUCKETS us are exact, above that each
+ *                power of two is split into HALF_BUCKETS linear buckets
+ */
+size_t Histogram::BucketIndex(uint64_t us)
+{
+	if (us < SUB_BUCKETS)
+		return us;
+
+	unsigned int msb = 0;
+	for (uint64_t v = us; v >>= 1; )
+		msb++;
+	if (msb >= MAX_BITS)
+		return BUCKETS - 1;
+
+	unsigned int shift = msb - (SUB_BITS - 1);
+	return SUB_BUCKETS + (msb - SUB_BITS) * HALF_BUCKETS
+		+ (us >> shift) - HALF_BUCKETS;
+}
+
+uint64_t Histogram::BucketLow(size_t index)
+{
+	if (index < SUB_BUCKETS)
+		return index;
+
+	size_t k = index - SUB_BUCKETS;
+	unsigned int msb = k / HALF_BUCKETS + SUB_BITS;
+	uint64_t sub = k % HALF_BUCKETS + HALF_BUCKETS;
+	return sub << (msb - (SUB_BITS - 1));
+}
+
+uint64_t Histogram::BucketHigh(size_t index)
+{
+	if (index < SUB_BUCKETS)
+		return index;
+
+	size_t k = index - SUB_BUCKETS;
+	unsigned int msb = k / HALF_BUCKETS + SUB_BITS;
+	return BucketLow(index) + (1ULL << (msb - (SUB_BITS - 1))) - 1;
+}
+
+void Histogram::Add(double ms)
+{
+	if (ms < 0)
+		ms = 0;
+	m_buckets[BucketIndex((uint64_t)(ms * 1000.0 + 0.5))]++;
+	if (m_count == 0 || ms < m_min)
+		m_min = ms;
+	if (m_count == 0 || ms > m_max)
+		m_max = ms;
+	m_sum += ms;
+	m_count++;
+}
+
+void Histogram::Merge(const Histogram& other)
+{
+	if (other.m_count == 0)
+		return;
+	for (size_t i = 0; i < BUCKETS; ++i)
+		m_buckets[i] += other.m_buckets[i];
+	if (m_count == 0 || other.m_min < m_min)
+		m_min = other.m_min;
+	if (m_count == 0 || other.m_max > m_max)
+		m_max = other.m_max;
+	m_sum += other.m_sum;
+	m_count += other.m_count;
+}
+
+/*
+ * Subtract: turn a running total into the delta since previous, min and max
+ *           can't be subtracted so they are approximated from the buckets
+ */
+void Histogram::Subtract(const Histogram& previous)
+{
+	size_t low = BUCKETS, high = 0;
+	for (size_t i = 0; i < BUCKETS; ++i)
+	{
+		m_buckets[i] -= previous.m_buckets[i];
+		if (m_buckets[i])
+		{
+			if (low == BUCKETS)
+				low = i;
+			high = i;
+		}
+	}
+	m_sum -= previous.m_sum;
+	m_count -= previous.m_count;
+	if (low == BUCKETS)
+	{
+		m_count = 0;
+		m_sum = m_min = m_max = 0;
+		return;
+	}
+	m_min = BucketLow(low) / 1000.0;
+	m_max = BucketHigh(high) / 1000.0;
+}
+
+double Histogram::Percentile(double percent) const
+{
+	if (m_count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(percent / 100.0 * m_count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > m_count)
+		rank = m_count;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKETS; ++i)
+	{
+		seen += m_buckets[i];
+		if (seen >= rank)
+		{
+			double ms = (BucketLow(i) + BucketHigh(i)) / 2000.0;
+			if (ms < m_min)
+				return m_min;
+			if (ms > m_max)
+				return m_max;
+			return ms;
+		}
+	}
+	return m_max;
+}
+
+/*
+ * MannWhitney: two-sided p-value of a Mann-Whitney U test of whether this
+ *              and other come from the same distribution, z (the normal
+ *              approximation of U) is positive if this one is slower.
+ *              Values in the same bucket are ties, whose ranks are averaged
+ */
+double Histogram::MannWhitney(const Histogram& other, double* z) const
+{
+	if (z)
+		*z = 0;
+	double n1 = m_count, n2 = other.m_count, n = n1 + n2;
+	if (n1 == 0 || n2 == 0)
+		return 1;
+
+	double u = 0, below = 0, ties = 0;
+	for (size_t i = 0; i < BUCKETS; ++i)
+	{
+		double a = m_buckets[i], b = other.m_buckets[i], t = a + b;
+		u += a * (below + b / 2);
+		below += b;
+		ties += t * t * t - t;
+	}
+	double variance = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+	if (variance <= 0)
+		return 1;
+	double score = (u - n1 * n2 / 2) / sqrt(variance);
+	if (z)
+		*z = score;
+	return erfc(fabs(score) / sqrt(2.0));
+}
+
+void Statistics::Clear()
+{
+	memset((void*)this, 0, sizeof *this);
+}
+
+void Statistics::Merge(const Statistics& other)
+{
+	messages += other.messages;
+	errors += other.errors;
+	deferred += other.deferred;
+	rejected += other.rejected;
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		failed[i] += other.failed[i];
+	for (size_t i = 0; i < REPLY_CODES; ++i)
+		failed_code[i] += other.failed_code[i];
+	connections += other.connections;
+	closed += other.closed;
+	fastopen += other.fastopen;
+	for (size_t i = 0; i < TRANSFER_MAX; ++i)
+		transfer[i] += other.transfer[i];
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		phase[i].Merge(other.phase[i]);
+	total.Merge(other.total);
+	lag.Merge(other.lag);
+	chunk.Merge(other.chunk);
+	recipient.Merge(other.recipient);
+	setup.Merge(other.setup);
+	for (size_t i = 0; i < FAMILY_MAX; ++i)
+		family[i].Merge(other.family[i]);
+	for (size_t i = 0; i < SIZE_CLASSES; ++i)
+	{
+		size_class[i].messages += other.size_class[i].messages;
+		size_class[i].datasent.Merge(other.size_class[i].datasent);
+		size_class[i].total.Merge(other.size_class[i].total);
+	}
+	for (size_t i = 0; i < Resolver::RR_MAX; ++i)
+	{
+		dns[i].queries += other.dns[i].queries;
+		dns[i].nxdomain += other.dns[i].nxdomain;
+		dns[i].servfail += other.dns[i].servfail;
+		dns[i].timeouts += other.dns[i].timeouts;
+		dns[i].errors += other.dns[i].errors;
+		dns[i].answers += other.dns[i].answers;
+		dns[i].bytes += other.dns[i].bytes;
+		if (other.dns[i].max_bytes > dns[i].max_bytes)
+			dns[i].max_bytes = other.dns[i].max_bytes;
+		dns[i].latency.Merge(other.dns[i].latency);
+	}
+	client.user_us += other.client.user_us;
+	client.system_us += other.client.system_us;
+	client.run_delay_us += other.client.run_delay_us;
+	client.preempted += other.client.preempted;
+	client.syscalls += other.client.syscalls;
+	client.sent += other.client.sent;
+	client.received += other.client.received;
+}
+
+void Statistics::Subtract(const Statistics& previous)
+{
+	messages -= previous.messages;
+	errors -= previous.errors;
+	deferred -= previous.deferred;
+	rejected -= previous.rejected;
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		failed[i] -= previous.failed[i];
+	for (size_t i = 0; i < REPLY_CODES; ++i)
+		failed_code[i] -= previous.failed_code[i];
+	connections -= previous.connections;
+	closed -= previous.closed;
+	fastopen -= previous.fastopen;
+	for (size_t i = 0; i < TRANSFER_MAX; ++i)
+		transfer[i] -= previous.transfer[i];
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		phase[i].Subtract(previous.phase[i]);
+	total.Subtract(previous.total);
+	lag.Subtract(previous.lag);
+	chunk.Subtract(previous.chunk);
+	recipient.Subtract(previous.recipient);
+	setup.Subtract(previous.setup);
+	for (size_t i = 0; i < FAMILY_MAX; ++i)
+		family[i].Subtract(previous.family[i]);
+	for (size_t i = 0; i < SIZE_CLASSES; ++i)
+	{
+		size_class[i].messages -= previous.size_class[i].messages;
+		size_class[i].datasent.Subtract(previous.size_class[i].datasent);
+		size_class[i].total.Subtract(previous.size_class[i].total);
+	}
+	/* max_bytes can't be subtracted, it's kept */
+	for (size_t i = 0; i < Resolver::RR_MAX; ++i)
+	{
+		dns[i].queries -= previous.dns[i].queries;
+		dns[i].nxdomain -= previous.dns[i].nxdomain;
+		dns[i].servfail -= previous.dns[i].servfail;
+		dns[i].timeouts -= previous.dns[i].timeouts;
+		dns[i].errors -= previous.dns[i].errors;
+		dns[i].answers -= previous.dns[i].answers;
+		dns[i].bytes -= previous.dns[i].bytes;
+		dns[i].latency.Subtract(previous.dns[i].latency);
+	}
+	client.user_us -= previous.client.user_us;
+	client.system_us -= previous.client.system_us;
+	client.run_delay_us -= previous.client.run_delay_us;
+	client.preempted -= previous.client.preempted;
+	client.syscalls -= previous.client.syscalls;
+	client.sent -= previous.client.sent;
+	client.received -= previous.client.received;
+}
+
+/*
+ * Format: count, sum, min and max, then index:count of the buckets in use
+ */
+string Histogram::Format() const
+{
+	char buf[128];
+	snprintf(buf, sizeof buf, "%llu %.17g %.17g %.17g",
+			(unsigned long long)m_count, m_sum, m_min, m_max);
+	string text = buf;
+	for (size_t i = 0; i < BUCKETS; ++i)
+		if (m_buckets[i])
+		{
+			snprintf(buf, sizeof buf, " %zu:%u", i, (unsigned int)m_buckets[i]);
+			text += buf;
+		}
+	return text;
+}
+
+/*
+ * Parse: read what Format wrote, false if it's malformed
+ */
+bool Histogram::Parse(const char* text)
+{
+	Clear();
+	unsigned long long count;
+	int n = 0;
+	if (sscanf(text, "%llu %lf %lf %lf%n", &count, &m_sum, &m_min, &m_max,
+				&n) != 4)
+		return false;
+	m_count = count;
+	text += n;
+
+	size_t index;
+	unsigned int bucket;
+	while (sscanf(text, " %zu:%u%n", &index, &bucket, &n) == 2)
+	{
+		if (index >= BUCKETS)
+			return false;
+		m_buckets[index] = bucket;
+		text += n;
+	}
+	return text[strspn(text, " \r")] == '\0';
+}
+
+/* of Resolver's record types, as in the names of the dns fields */
+static const char* DNSFieldName[Resolver::RR_MAX] = { "mx", "a", "aaaa" };
+
+/*
+ * Fields: visit each counter and histogram by the name it's formatted with,
+ *         names may be added but not changed, as readers skip unknown ones
+ */
+template <class S, class V>
+static void Fields(S& s, V& visit)
+{
+	visit("messages", s.messages);
+	visit("errors", s.errors);
+	visit("deferred", s.deferred);
+	visit("rejected", s.rejected);
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		visit(string("failed.") + SMTPPhaseName[i], s.failed[i]);
+	for (size_t i = 0; i < Statistics::REPLY_CODES; ++i)
+		visit("failed_code." + std::to_string(400 + i), s.failed_code[i]);
+	visit("connections", s.connections);
+	visit("closed", s.closed);
+	visit("fastopen", s.fastopen);
+	for (size_t i = 0; i < TRANSFER_MAX; ++i)
+		visit(string("transfer.") + SMTPTransferName[i], s.transfer[i]);
+	for (size_t i = 0; i < PHASE_MAX; ++i)
+		visit(string("phase.") + SMTPPhaseName[i], s.phase[i]);
+	visit("total", s.total);
+	visit("lag", s.lag);
+	visit("chunk", s.chunk);
+	visit("recipient", s.recipient);
+	visit("setup", s.setup);
+	visit("family.ipv4", s.family[Statistics::FAMILY_IPV4]);
+	visit("family.ipv6", s.family[Statistics::FAMILY_IPV6]);
+	for (size_t i = 0; i < Statistics::SIZE_CLASSES; ++i)
+	{
+		string name = "size_class." + std::to_string(i) + ".";
+		visit(name + "messages", s.size_class[i].messages);
+		visit(name + "datasent", s.size_class[i].datasent);
+		visit(name + "total", s.size_class[i].total);
+	}
+	for (size_t i = 0; i < Resolver::RR_MAX; ++i)
+	{
+		string name = string("dns.") + DNSFieldName[i] + ".";
+		visit(name + "queries", s.dns[i].queries);
+		visit(name + "nxdomain", s.dns[i].nxdomain);
+		visit(name + "servfail", s.dns[i].servfail);
+		visit(name + "timeouts", s.dns[i].timeouts);
+		visit(name + "errors", s.dns[i].errors);
+		visit(name + "answers", s.dns[i].answers);
+		visit(name + "bytes", s.dns[i].bytes);
+		visit(name + "max_bytes", s.dns[i].max_bytes);
+		visit(name + "latency", s.dns[i].latency);
+	}
+	visit("client.user_us", s.client.user_us);
+	visit("client.system_us", s.client.system_us);
+	visit("client.run_delay_us", s.client.run_delay_us);
+	visit("client.preempted", s.client.preempted);
+	visit("client.syscalls", s.client.syscalls);
+	visit("client.sent", s.client.sent);
+	visit("client.received", s.client.received);
+}
+
+/* FieldFormatter: a line per field that isn't zero */
+struct FieldFormatter
+{
+	string text;
+
+	void operator()(const string& name, const uint64_t& value)
+	{
+		if (value)
+			text += name + " " + std::to_string(value) + "\n";
+	}
+	void operator()(const string& name, const Histogram& histogram)
+	{
+		if (histogram.Count())
+			text += name + " " + histogram.Format() + "\n";
+	}
+};
+
+/* FieldIndex: the fields by name */
+struct FieldIndex
+{
+	std::map<string, uint64_t*> counters;
+	std::map<string, Histogram*> histograms;
+
+	void operator()(const string& name, uint64_t& value)
+		{ counters[name] = &value; }
+	void operator()(const string& name, Histogram& histogram)
+		{ histograms[name] = &histogram; }
+};
+
+/*
+ * Format: the histogram geometry, then "name value" for each counter and
+ *         "name count sum min max index:count..." for each histogram,
+ *         leaving out those that are zero
+ *
+ *   histogram 6 36
+ *   messages 1200
+ *   phase.connect 1200 301.5 0.12 1.98 120:3 ...
+ */
+string Statistics::Format() const
+{
+	char buf[64];
+	snprintf(buf, sizeof buf, "histogram %d %d\n", (int)Histogram::SUB_BITS,
+			(int)Histogram::MAX_BITS);
+	FieldFormatter formatter;
+	formatter.text = buf;
+	Fields(*this, formatter);
+	return formatter.text;
+}
+
+/*
+ * Parse: read what Format wrote, the fields that aren't in it are zero and
+ *        names that aren't known are skipped
+ */
+bool Statistics::Parse(const string& text, string& error)
+{
+	Clear();
+	FieldIndex index;
+	Fields(*this, index);
+
+	std::istringstream iss(text);
+	string line;
+	bool geometry = false;
+	while (std::getline(iss, line))
+	{
+		size_t space = line.find(' ');
+		string name = line.substr(0, space);
+		const char* value = space == string::npos ? "" :
+			line.c_str() + space + 1;
+		if (name.empty())
+			continue;
+		if (name == "histogram")
+		{
+			int sub_bits = 0, max_bits = 0;
+			if (sscanf(value, "%d %d", &sub_bits, &max_bits) != 2 ||
+					sub_bits != Histogram::SUB_BITS ||
+					max_bits != Histogram::MAX_BITS)
+			{
+				error = "histograms of another geometry: " + line;
+				return false;
+			}
+			geometry = true;
+			continue;
+		}
+
+		std::map<string, uint64_t*>::const_iterator
+			counter = index.counters.find(name);
+		std::map<string, Histogram*>::const_iterator
+			histogram = index.histograms.find(name);
+		if (counter != index.counters.end())
+			*counter->second = strtoull(value, NULL, 10);
+		else if (histogram != index.histograms.end() &&
+				(!geometry || !histogram->second->Parse(value)))
+		{
+			error = "invalid histogram: " + line;
+			return false;
+		}
+	}
+	if (!geometry)
+	{
+		error = "no statistics";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,157 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _STATS_HPP_
+#define _STATS_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "session.hpp"
+#include "resolver.hpp"
+
+/*
+ * Histogram: log-linear latency histogram (values in ms, ~3% resolution)
+ *
+ * It is plain data, an all-zero histogram is empty, so it can be placed in
+ * memory shared between forked workers. Each histogram should only have one
+ * writer; readers (the parent) may see slightly stale values.
+ */
+class Histogram
+{
+	public:
+		enum {
+			SUB_BITS = 6,
+			SUB_BUCKETS = 1 << SUB_BITS,
+			HALF_BUCKETS = SUB_BUCKETS / 2,
+			MAX_BITS = 36,
+			BUCKETS = SUB_BUCKETS + (MAX_BITS - SUB_BITS) * HALF_BUCKETS,
+		};
+
+		void Clear();
+		void Add(double ms);
+		void Merge(const Histogram& other);
+		void Subtract(const Histogram& previous);
+
+		uint64_t Count() const { return m_count; }
+		double Min() const { return m_min; }
+		double Max() const { return m_max; }
+		double Mean() const { return m_count ? m_sum / m_count : 0; }
+		double Percentile(double percent) const;
+		double MannWhitney(const Histogram& other, double* z = NULL) const;
+
+		std::string Format() const;
+		bool Parse(const char* text);
+	private:
+		static size_t BucketIndex(uint64_t us);
+		static uint64_t BucketLow(size_t index);
+		static uint64_t BucketHigh(size_t index);
+
+		uint64_t m_count;
+		double m_sum;
+		double m_min;
+		double m_max;
+		uint32_t m_buckets[BUCKETS];
+};
+
+/*
+ * SizeClassStatistics: latency of one --size-mix message size class
+ */
+struct SizeClassStatistics
+{
+	uint64_t messages;
+	Histogram datasent;
+	Histogram total;
+};
+
+/*
+ * DNSStatistics: --dns lookups of one record type
+ */
+struct DNSStatistics
+{
+	uint64_t queries;
+	uint64_t nxdomain;
+	uint64_t servfail;
+	uint64_t timeouts;
+	uint64_t errors;	/* other failures */
+	uint64_t answers;	/* with a known size (not no data) */
+	uint64_t bytes;		/* of the answers */
+	uint64_t max_bytes;
+	Histogram latency;
+};
+
+/*
+ * ClientStatistics: smtpping's own resource use, to tell when it's the
+ *                   bottleneck rather than the server
+ */
+struct ClientStatistics
+{
+	uint64_t user_us;	/* cpu time */
+	uint64_t system_us;
+	uint64_t run_delay_us;	/* runnable, waiting for a cpu (Linux) */
+	uint64_t preempted;	/* involuntary context switches */
+	uint64_t syscalls;	/* made by sessions */
+	uint64_t sent;		/* bytes */
+	uint64_t received;
+};
+
+/*
+ * Statistics: counters and per-phase histograms of one worker
+ *
+ * Agents send them, and results are saved, as text (see Format) so that
+ * they can be read on another platform or by another build.
+ */
+struct Statistics
+{
+	enum { SIZE_CLASSES = 8, REPLY_CODES = 200 };
+	enum { FAMILY_IPV4, FAMILY_IPV6, FAMILY_MAX };
+
+	uint64_t messages;
+	uint64_t errors;
+	uint64_t deferred;	/* failed with a 4xx reply */
+	uint64_t rejected;	/* failed with a 5xx reply */
+	uint64_t failed[PHASE_MAX];	/* errors by phase */
+	uint64_t failed_code[REPLY_CODES];	/* errors by 4xx/5xx reply */
+	uint64_t connections;	/* opened, those not closed are active */
+	uint64_t closed;
+	uint64_t fastopen;	/* connections greeted in the SYN, their handshake
+				   is in the banner time */
+	uint64_t transfer[TRANSFER_MAX];	/* messages per path, with EHLO */
+	Histogram phase[PHASE_MAX];
+	Histogram total;
+	Histogram lag;		/* behind the --replay schedule */
+	Histogram chunk;	/* BDAT chunk acknowledgement */
+	Histogram recipient;	/* LMTP per-recipient delivery */
+	Histogram setup;	/* --pool connect, banner and EHLO */
+	Histogram family[FAMILY_MAX];	/* connect, by the family connected */
+	SizeClassStatistics size_class[SIZE_CLASSES];
+	DNSStatistics dns[Resolver::RR_MAX];
+	ClientStatistics client;
+
+	void Clear();
+	void Merge(const Statistics& other);
+	void Subtract(const Statistics& previous);
+
+	std::string Format() const;
+	bool Parse(const std::string& text, std::string& error);
+};
+
+#endif
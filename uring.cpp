@@ -0,0 +1,264 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include "uring.hpp"
+
+#ifdef HAVE_IO_URING
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+using std::string;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+IOUring::IOUring()
+: m_fd(-1), m_buffer(NULL), m_queued(0), m_sq_ptr(MAP_FAILED), m_sq_size(0),
+  m_cq_ptr(MAP_FAILED), m_cq_size(0), m_sqes((struct io_uring_sqe*)MAP_FAILED),
+  m_sqes_size(0)
+{
+}
+
+IOUring::~IOUring()
+{
+	/* closing the last session */
+	if (m_queued)
+		Submit(0);
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+		munmap(m_cq_ptr, m_cq_size);
+	if (m_sq_ptr != MAP_FAILED)
+		munmap(m_sq_ptr, m_sq_size);
+	if (m_fd != -1)
+		close(m_fd);
+	free(m_buffer);
+}
+
+/*
+ * Setup: create the ring and register the read buffer, false (see
+ *        GetError) if io_uring or one of the operations is unavailable
+ */
+bool IOUring::Setup()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	m_fd = syscall(__NR_io_uring_setup, ENTRIES, &p);
+	if (m_fd == -1)
+	{
+		m_error = string("io_uring_setup: ") + strerror(errno);
+		return false;
+	}
+
+	/* the operations we use */
+	const int ops[] = { IORING_OP_SEND, IORING_OP_READ_FIXED,
+		IORING_OP_CONNECT, IORING_OP_SHUTDOWN, IORING_OP_CLOSE };
+	size_t probe_size = sizeof(struct io_uring_probe) +
+		IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+	bool supported = probe && syscall(__NR_io_uring_register, m_fd,
+			IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+	for (size_t i = 0; supported && i < sizeof ops / sizeof ops[0]; ++i)
+		supported = ops[i] <= probe->last_op &&
+			(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!supported)
+	{
+		m_error = "io_uring: operations not supported by the kernel";
+		return false;
+	}
+
+	m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		m_sq_size = m_cq_size = m_sq_size > m_cq_size ? m_sq_size : m_cq_size;
+	m_sq_ptr = mmap(NULL, m_sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ptr != MAP_FAILED)
+		m_cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP ? m_sq_ptr :
+			mmap(NULL, m_cq_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (m_cq_ptr != MAP_FAILED)
+		m_sqes = (struct io_uring_sqe*)mmap(NULL, m_sqes_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+				IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+	{
+		m_error = string("io_uring: mmap: ") + strerror(errno);
+		return false;
+	}
+
+	char* sq = (char*)m_sq_ptr;
+	char* cq = (char*)m_cq_ptr;
+	m_sq_head = (unsigned int*)(sq + p.sq_off.head);
+	m_sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	m_sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+	m_sq_entries = p.sq_entries;
+	m_sq_array = (unsigned int*)(sq + p.sq_off.array);
+	m_cq_head = (unsigned int*)(cq + p.cq_off.head);
+	m_cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	m_cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+	m_cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	/* replies are read into a registered buffer, pinned once */
+	m_buffer = (char*)malloc(BUFFER_SIZE);
+	struct iovec iov = { m_buffer, BUFFER_SIZE };
+	if (!m_buffer || syscall(__NR_io_uring_register, m_fd,
+				IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+	{
+		m_error = string("io_uring: register buffers: ") + strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Queue: the next free submission entry, submitting if the ring is full
+ */
+struct io_uring_sqe* IOUring::Queue()
+{
+	unsigned int tail = *m_sq_tail;
+	while (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+		Submit(0);
+	struct io_uring_sqe* sqe = &m_sqes[tail & m_sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	m_sq_array[tail & m_sq_mask] = tail & m_sq_mask;
+	return sqe;
+}
+
+/*
+ * Send: queue a send, linked to the operation queued after it so that a
+ *       command is sent before its reply is read
+ */
+void IOUring::Send(int fd, const void* data, size_t size, int flags,
+		uint64_t user)
+{
+	struct io_uring_sqe* sqe = Queue();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = size;
+	sqe->msg_flags = flags | MSG_NOSIGNAL;
+	sqe->user_data = user;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+}
+
+/*
+ * Read: queue a read into the registered buffer
+ */
+void IOUring::Read(int fd, uint64_t user)
+{
+	struct io_uring_sqe* sqe = Queue();
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)m_buffer;
+	sqe->len = BUFFER_SIZE;
+	sqe->buf_index = 0;
+	sqe->user_data = user;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+}
+
+/*
+ * Connect: queue a connect, addr must stay valid until it has completed
+ */
+void IOUring::Connect(int fd, const struct sockaddr* addr, socklen_t size,
+		uint64_t user)
+{
+	struct io_uring_sqe* sqe = Queue();
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->off = size;
+	sqe->user_data = user;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+}
+
+/*
+ * Close: queue a shutdown and close of fd, submitted with whatever is
+ *        submitted next (the fd number isn't reused until it's closed)
+ */
+void IOUring::Close(int fd)
+{
+	struct io_uring_sqe* sqe = Queue();
+	sqe->opcode = IORING_OP_SHUTDOWN;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->fd = fd;
+	sqe->len = SHUT_RDWR;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+
+	sqe = Queue();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued++;
+}
+
+/*
+ * Submit: submit the queued operations and wait for wait completions
+ */
+bool IOUring::Submit(unsigned int wait)
+{
+	for (;;)
+	{
+		int r = syscall(__NR_io_uring_enter, m_fd, m_queued, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r >= 0)
+		{
+			m_queued -= r;
+			return true;
+		}
+		if (errno != EINTR)
+			return false;
+	}
+}
+
+/*
+ * Reap: the next completion, false when there is none
+ */
+bool IOUring::Reap(uint64_t& user, int& result)
+{
+	unsigned int head = *m_cq_head;
+	while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe* cqe = &m_cqes[head & m_cq_mask];
+		user = cqe->user_data;
+		result = cqe->res;
+		__atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+		if (user != 0)
+			return true;
+	}
+	return false;
+}
+
+#endif
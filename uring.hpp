@@ -0,0 +1,87 @@
+/*
+	SMTP PING
+	Copyright (C) 2011 Halon Security <support@halon.se>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef _URING_HPP_
+#define _URING_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+
+/*
+ * IOUring: a minimal Linux io_uring (without liburing), used by Session to
+ *          submit a command and the read of its reply with one system call,
+ *          and a connect with the close of the previous session
+ *
+ * Operations are queued and only submitted by Submit(), so everything they
+ * point to must stay valid until then. Completions are handed back with the
+ * user value they were queued with; operations queued with user 0 (closing
+ * a finished session) are reaped silently. Reads go to one registered
+ * buffer, so a ring serves one session at a time.
+ */
+class IOUring
+{
+	public:
+		enum { ENTRIES = 64, BUFFER_SIZE = 16384 };
+
+		IOUring();
+		~IOUring();
+
+		bool Setup();
+		const std::string& GetError() const { return m_error; }
+		char* GetBuffer() const { return m_buffer; }
+
+		void Send(int fd, const void* data, size_t size, int flags,
+				uint64_t user);
+		void Read(int fd, uint64_t user);
+		void Connect(int fd, const struct sockaddr* addr, socklen_t size,
+				uint64_t user);
+		void Close(int fd);
+
+		bool Submit(unsigned int wait);
+		bool Reap(uint64_t& user, int& result);
+	private:
+		struct io_uring_sqe* Queue();
+
+		int m_fd;
+		std::string m_error;
+		char* m_buffer;
+		unsigned int m_queued;
+
+		void* m_sq_ptr;
+		size_t m_sq_size;
+		void* m_cq_ptr;
+		size_t m_cq_size;
+		struct io_uring_sqe* m_sqes;
+		size_t m_sqes_size;
+
+		unsigned int* m_sq_head;
+		unsigned int* m_sq_tail;
+		unsigned int m_sq_mask;
+		unsigned int m_sq_entries;
+		unsigned int* m_sq_array;
+		unsigned int* m_cq_head;
+		unsigned int* m_cq_tail;
+		unsigned int m_cq_mask;
+		struct io_uring_cqe* m_cqes;
+};
+
+#endif